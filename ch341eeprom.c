@@ -28,289 +28,969 @@
 #include <getopt.h>
 #include <limits.h>
 #include <sys/mman.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
 #include "ch341eeprom.h"
 
-FILE *debugout, *verbout;
-uint8_t *readbuf = NULL;
+FILE *debugout, *verbout, *msgout, *devnull;
+volatile sig_atomic_t ch341interrupted = FALSE;
 
-int main(int argc, char **argv) {
-    int i, eepromsize = 0, bytesread = 0;
-    uint8_t debug = FALSE, verbose = FALSE;
-    struct libusb_device_handle *devHandle = NULL;
-    char *filename = NULL, eepromname[12], operation = 0;
-    uint32_t speed = CH341_I2C_STANDARD_SPEED;
-    uint8_t *verifybuf;
-    uint8_t verify_failed = FALSE;
+void sigInterrupt(int sig) {
+    ch341interrupted = TRUE;
+}
+
+// block callback recording how far an in-order read has got
+int32_t cbReadMark(uint32_t offset, uint8_t *data, uint32_t len, void *arg) {
+    *(uint32_t *) arg = offset + len;
+    return 0;
+}
+
+// block callback passing each block on to a stream as soon as it arrives
+int32_t cbReadStream(uint32_t offset, uint8_t *data, uint32_t len, void *arg) {
+    FILE *out = (FILE *) arg;
+
+    if(fwrite(data, 1, len, out) != len || fflush(out)) {
+        fprintf(stderr, "Output stream closed at [%d] bytes, stopping read\n", offset);
+        return -1;
+    }
+    return 0;
+}
+
+// block callback of the whole EEPROM reads: adds each block to the checksum
+// before handing it on to the callback of the read mode, if any
+int32_t cbReadHash(uint32_t offset, uint8_t *data, uint32_t len, void *arg) {
+    struct ch341readsink *sink = (struct ch341readsink *) arg;
+
+    if(sink->hash->type != HASH_NONE)
+        ch341hashUpdate(sink->hash, data, len);
+    return sink->next ? sink->next(offset, data, len, sink->arg) : 0;
+}
+
+// print the finished checksum of what was read or written and compare it
+// with the expected one, if any. returns -1 if they differ
+int32_t printChecksum(struct ch341hash *hash, char *what, char *expect) {
+    char hex[HASH_MAX_HEX];
+
+    ch341hashFinal(hash, hex);
+    fprintf(msgout, "Checksum %s of [%llu] bytes %s: %s\n", ch341hashName(hash->type), (unsigned long long) hash->bytes, what, hex);
+    if(*expect && strcasecmp(hex, expect)) {
+        fprintf(stderr, "Checksum %s doesnt match the expected [%s]\n", hex, expect);
+        return -1;
+    }
+    return 0;
+}
+
+// carry out the operation of a job on one configured adapter, with readbuf
+// (MAX_EEPROM_SIZE bytes) for the EEPROM image. returns the exit status
+int32_t ch341runJob(struct ch341job *job, struct ch341ctx *ctx, uint8_t *readbuf) {
+    int i, bytesread = 0;
+    uint8_t *verifybuf, *image, *chipbuf = NULL, *targetbuf = NULL;
     FILE *fp;
+    struct ch341range readranges[MAX_READ_RANGES], range, *dirty = NULL;
+    struct EEPROM targets[MAX_TARGETS];
+    uint32_t readdone = 0, ndirty, dirtybytes, npages, t;
+    int32_t pageswritten, first, exitcode = EXIT_ERROR;
+    struct ch341readsink sink = {&job->hash, NULL, NULL};
+    char hashwhat[64];
+
+    *ch341ctxTuning(ctx) = job->tuning;             // the engine reads and writes as this job asks
+    ch341ctxSetOutput(ctx, msgout, verbout, debugout);
+
+    switch(job->operation) {
+        case 'r':   // read
+            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+
+            if(job->nranges) {                      // the engine sorts and merges its copy of the ranges
+                memcpy(readranges, job->ranges, job->nranges * sizeof(struct ch341range));
+                if(ch341readRanges(ctx, readbuf, readranges, job->nranges, &job->eeprom_info, NULL, NULL) < 0) {
+                    fprintf(stderr, "Couldnt read [%d] ranges from [%s] EEPROM\n", job->nranges, job->eepromname);
+                    goto out;
+                }
+                fprintf(msgout, "Read [%d] bytes in [%d] ranges from [%s] EEPROM\n", job->rangebytes, job->nranges, job->eepromname);
+
+                for(i=0; i < job->nranges; i++) {
+                    if(!job->rangefiles[i])
+                        continue;
+                    if(!(fp=fopen(job->rangefiles[i], "wb"))) {
+                        fprintf(stderr, "Couldnt open file [%s] for writing\n", job->rangefiles[i]);
+                        goto out;
+                    }
+                    fwrite(readbuf + job->ranges[i].offset, 1, job->ranges[i].length, fp);
+                    if(ferror(fp)) {
+                        fprintf(stderr, "Error writing file [%s]\n", job->rangefiles[i]);
+                        fclose(fp);
+                        goto out;
+                    }
+                    fclose(fp);
+                    fprintf(msgout, "Wrote [%d] bytes from [0x%x] to file [%s]\n", job->ranges[i].length, job->ranges[i].offset, job->rangefiles[i]);
+                }
+                if(!job->filename)
+                    break;
+                                                    // sparse image: only the ranges read are written,
+                                                    // everything else is left as a hole
+                if(!(fp=fopen(job->filename, "wb"))) {
+                    fprintf(stderr, "Couldnt open file [%s] for writing\n", job->filename);
+                    goto out;
+                }
+                for(i=0; i < job->nranges; i++) {
+                    if(job->rangefiles[i])
+                        continue;
+                    fseek(fp, job->ranges[i].offset, SEEK_SET);
+                    fwrite(readbuf + job->ranges[i].offset, 1, job->ranges[i].length, fp);
+                }
+                fflush(fp);
+                if(ferror(fp) || ftruncate(fileno(fp), job->eepromsize) < 0) {
+                    fprintf(stderr, "Error writing file [%s]\n", job->filename);
+                    fclose(fp);
+                    goto out;
+                }
+                fclose(fp);
+                fprintf(msgout, "Wrote sparse [%d] byte image to file [%s]\n", job->eepromsize, job->filename);
+                break;
+            }
+
+            if(job->tostdout) {                     // hand each block to the reader as it arrives
+                signal(SIGPIPE, SIG_IGN);           // a reader that has seen enough just stops the read
+                range = (struct ch341range) {0, job->eepromsize};
+                sink.next = cbReadStream;
+                sink.arg  = stdout;
+                if(ch341readRanges(ctx, readbuf, &range, 1, &job->eeprom_info, cbReadHash, &sink) < 0) {
+                    fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                    goto out;
+                }
+                fprintf(msgout, "Read [%d] bytes from [%s] EEPROM to stdout\n", job->eepromsize, job->eepromname);
+                break;
+            }
+
+            if(job->usemmap) {                      // the file is the read buffer, the data lands in its page cache
+                if(!(fp=fopen(job->filename, "w+b"))) {
+                    fprintf(stderr, "Couldnt open file [%s] for writing\n", job->filename);
+                    goto out;
+                }
+                if(ftruncate(fileno(fp), job->eepromsize) < 0 ||
+                   (image = mmap(NULL, job->eepromsize, PROT_READ | PROT_WRITE, MAP_SHARED, fileno(fp), 0)) == MAP_FAILED) {
+                    fprintf(stderr, "Error mapping file [%s]\n", job->filename);
+                    fclose(fp);
+                    goto out;
+                }
+                range = (struct ch341range) {0, job->eepromsize};
+                sink.next = cbReadMark;
+                sink.arg  = &readdone;
+                if(ch341readRanges(ctx, image, &range, 1, &job->eeprom_info, cbReadHash, &sink) < 0) {
+                    munmap(image, job->eepromsize); // keep exactly the bytes that were read
+                    if(ftruncate(fileno(fp), readdone) < 0)
+                        fprintf(stderr, "Error truncating file [%s]\n", job->filename);
+                    fclose(fp);
+                    fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM, kept [%d] bytes in file [%s]\n", job->eepromsize, job->eepromname, readdone, job->filename);
+                    goto out;
+                }
+                fprintf(msgout, "Read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                for(i=0;i<job->eepromsize;i++) {
+                    if(!(i%16))
+                        fprintf(debugout, "\n%04x: ", i);
+                    fprintf(debugout, "%02x ", image[i]);
+                }
+                fprintf(debugout, "\n");
+                munmap(image, job->eepromsize);
+                fclose(fp);
+                fprintf(msgout, "Wrote [%d] bytes to file [%s]\n", job->eepromsize, job->filename);
+                break;
+            }
+
+            range = (struct ch341range) {0, job->eepromsize};
+            if(ch341readRanges(ctx, readbuf, &range, 1, &job->eeprom_info, cbReadHash, &sink) < 0) {
+                fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                goto out;
+            }
+            fprintf(msgout, "Read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+            for(i=0;i<job->eepromsize;i++) {
+                if(!(i%16))
+                    fprintf(debugout, "\n%04x: ", i);
+                fprintf(debugout, "%02x ", readbuf[i]);
+            }
+            fprintf(debugout, "\n");
+            if(!job->filename)                      // checksum only
+                break;
+
+            if(!(fp=fopen(job->filename, "wb"))) {
+                fprintf(stderr, "Couldnt open file [%s] for writing\n", job->filename);
+                goto out;
+            }
+
+            fwrite(readbuf, 1, job->eepromsize, fp);
+            if(ferror(fp)) {
+                fprintf(stderr, "Error writing file [%s]\n", job->filename);
+                if(fp)
+                    fclose(fp);
+                goto out;
+            }
+            fclose(fp);
+            fprintf(msgout, "Wrote [%d] bytes to file [%s]\n", job->eepromsize, job->filename);
+            break;
+        case 'V':   // verify
+            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+
+            if(!(fp=fopen(job->filename, "rb"))) {
+                fprintf(stderr, "Couldnt open file [%s] for reading\n", job->filename);
+                goto out;
+            }
+
+            verifybuf = mmap(NULL, job->eepromsize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
+            if(verifybuf == MAP_FAILED) {
+                fprintf(stderr, "Error mapping file [%s]\n", job->filename);
+                if(fp)
+                    fclose(fp);
+                goto out;
+            }
+                                                    // blocks are compared as they arrive from the EEPROM
+            job->verify.image = verifybuf;
+            if(ch341verifyEEPROM(ctx, readbuf, job->eepromsize, &job->verify, &job->eeprom_info) < 0) {
+                fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                munmap(verifybuf, job->eepromsize);
+                fclose(fp);
+                goto out;
+            }
+
+            if(!job->verify.mismatches || job->verify.fullreport) {
+                fprintf(msgout, "Read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                for(i=0;i<job->eepromsize;i++) {
+                    if(!(i%16))
+                        fprintf(debugout, "\n%04x: ", i);
+                    fprintf(debugout, "%02x ", readbuf[i]);
+                }
+                fprintf(debugout, "\n");
+            }
+
+            if(job->verify.fullreport && job->verify.mismatches) {
+                for(i=0; i < job->verify.nranges; i++)
+                    fprintf(msgout, "Mismatch at [%04x] of [%d] bytes\n", job->verify.ranges[i].offset, job->verify.ranges[i].length);
+                fprintf(msgout, "Verification against file [%s] failed, [%d] bytes differ in [%d] ranges\n", job->filename,
+                        job->verify.mismatches, job->verify.nranges);
+            } else if(job->verify.mismatches)
+                fprintf(msgout, "Verification against file [%s] failed at offset [%d], EEPROM: %02hhX, file: %02hhX\n", job->filename,
+                        job->verify.first, readbuf[job->verify.first], verifybuf[job->verify.first]);
+            else
+                fprintf(msgout, "Verified [%d] bytes against file [%s]\n", job->eepromsize, job->filename);
+
+            munmap(verifybuf, job->eepromsize);
+            fclose(fp);
+            if(job->verify.mismatches) {
+                exitcode = EXIT_MISMATCH;
+                goto out;
+            }
+            break;
+        case 'w':   // write
+            if(!(fp=fopen(job->filename, "rb"))) {
+                fprintf(stderr, "Couldnt open file [%s] for reading\n", job->filename);
+                goto out;
+            }
+            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+            if(job->partialwrite) {
+                if(!job->writelength)
+                    job->writelength = job->eepromsize - job->writeoffset;
+                bytesread = fread(readbuf + job->writeoffset, 1, job->writelength, fp);
+            } else
+                bytesread = fread(readbuf, 1, MAX_EEPROM_SIZE, fp);
+            if(ferror(fp)) {
+                fprintf(stderr, "Error reading file [%s]\n", job->filename);
+                if(fp)
+                    fclose(fp);
+                goto out;
+            }
+            fclose(fp);
+            fprintf(msgout, "Read [%d] bytes from file [%s]\n", bytesread, job->filename);
+                                                    // the bytes going to the EEPROM, after padding or truncation
+            if(job->hash.type != HASH_NONE) {
+                if(job->partialwrite)
+                    ch341hashUpdate(&job->hash, readbuf + job->writeoffset, bytesread);
+                else
+                    ch341hashUpdate(&job->hash, readbuf, job->eepromsize);
+                snprintf(hashwhat, sizeof(hashwhat), "written from file [%.32s]", job->filename);
+                if(printChecksum(&job->hash, hashwhat, job->hashexpect) < 0) {
+                    exitcode = EXIT_MISMATCH;       // not the image that was meant, leave the EEPROM alone
+                    goto out;
+                }
+            }
+
+            if(job->partialwrite) {                 // only the pages the bytes fall in are touched
+                job->patches[0].offset = job->writeoffset;
+                job->patches[0].length = bytesread;
+                if(!bytesread || (pageswritten = ch341patchEEPROM(ctx, readbuf, job->patches, 1, &job->eeprom_info)) < 0) {
+                    fprintf(stderr,"Failed to write [%d] bytes from [%s] at [0x%x] of [%s] EEPROM\n", bytesread, job->filename, job->writeoffset, job->eepromname);
+                    goto out;
+                }
+                fprintf(msgout, "Wrote %s[%d] bytes at [0x%x] of [%s] EEPROM in [%d] changed pages\n",
+                    job->tuning.writeverify ? "and verified " : "", bytesread, job->writeoffset, job->eepromname, pageswritten);
+                break;
+            }
+
+            if(bytesread < job->eepromsize)
+                fprintf(msgout, "Padded to [%d] bytes for [%s] EEPROM\n", job->eepromsize, job->eepromname);
+
+            if(bytesread > job->eepromsize)
+                fprintf(msgout, "Truncated to [%d] bytes for [%s] EEPROM\n", job->eepromsize, job->eepromname);
+
+            if(job->diffwrite) {
+                npages = (job->eepromsize + job->eeprom_info.page_size - 1) / job->eeprom_info.page_size;
+                chipbuf = (uint8_t *) malloc(MAX_EEPROM_SIZE);
+                dirty = (struct ch341range *) malloc((npages + 1) * sizeof(struct ch341range));
+                if(!chipbuf || !dirty) {
+                    fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
+                    goto out;
+                }
+                if(ch341readEEPROM(ctx, chipbuf, job->eepromsize, &job->eeprom_info) < 0) {
+                    fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                    goto out;
+                }
+                ndirty = ch341diffPages(chipbuf, readbuf, job->eepromsize, job->eeprom_info.page_size, dirty);
+                for(dirtybytes = 0, i = 0; i < ndirty; i++)
+                    dirtybytes += dirty[i].length;
+
+                if(ch341writeRanges(ctx, readbuf, dirty, ndirty, &job->eeprom_info) < 0) {
+                    fprintf(stderr,"Failed to write [%d] changed bytes from [%s] to [%s] EEPROM\n", dirtybytes, job->filename, job->eepromname);
+                    goto out;
+                }
+                i = (dirtybytes + job->eeprom_info.page_size - 1) / job->eeprom_info.page_size;
+                fprintf(msgout, "Wrote %s[%d] changed pages to [%s] EEPROM, skipped [%d] unchanged pages\n",
+                    job->tuning.writeverify ? "and verified " : "", i, job->eepromname, npages - i);
+                break;
+            }
+
+            if(ch341writeEEPROM(ctx, readbuf, job->eepromsize, &job->eeprom_info) < 0) {
+                fprintf(stderr,"Failed to write [%d] bytes from [%s] to [%s] EEPROM\n", job->eepromsize, job->filename, job->eepromname);
+                goto out;
+            }
+            fprintf(msgout, "Wrote %s[%d] bytes to [%s] EEPROM\n", job->tuning.writeverify ? "and verified " : "", job->eepromsize, job->eepromname);
+            break;
+        case 'C': // calibration only, done above
+            break;
+        case 'x': // patch
+            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+            for(i=0; i < job->npatches; i++)        // later patches win where they overlap
+                memcpy(readbuf + job->patches[i].offset, job->patchdata[i], job->patches[i].length);
+            if((pageswritten = ch341patchEEPROM(ctx, readbuf, job->patches, job->npatches, &job->eeprom_info)) < 0) {
+                fprintf(stderr,"Failed to patch [%d] bytes of [%s] EEPROM\n", job->patchbytes, job->eepromname);
+                goto out;
+            }
+            fprintf(msgout, "Patched [%d] bytes in [%d] places of [%s] EEPROM, [%d] pages changed\n", job->patchbytes, job->npatches, job->eepromname, pageswritten);
+            break;
+        case 't':   // one image per chip select, written interleaved
+            npages = job->eepromsize / job->eeprom_info.page_size;
+            if(!(targetbuf = (uint8_t *) malloc(job->ntargets * job->eepromsize))) {
+                fprintf(stderr, "Couldnt malloc space needed for EEPROM images\n");
+                goto out;
+            }
+            for(t=0; t < job->ntargets; t++) {
+                if(!(fp=fopen(job->targetfiles[t], "rb"))) {
+                    fprintf(stderr, "Couldnt open file [%s] for reading\n", job->targetfiles[t]);
+                    goto out;
+                }
+                memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+                bytesread = fread(readbuf, 1, MAX_EEPROM_SIZE, fp);
+                if(ferror(fp)) {
+                    fprintf(stderr, "Error reading file [%s]\n", job->targetfiles[t]);
+                    fclose(fp);
+                    goto out;
+                }
+                fclose(fp);
+                fprintf(msgout, "Read [%d] bytes from file [%s] for chip select [%d]\n", bytesread, job->targetfiles[t], job->targetcs[t]);
+                if(bytesread < job->eepromsize)
+                    fprintf(msgout, "Padded to [%d] bytes for [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                if(bytesread > job->eepromsize)
+                    fprintf(msgout, "Truncated to [%d] bytes for [%s] EEPROM\n", job->eepromsize, job->eepromname);
+
+                for(i=0; i < npages; i++)           // page i of target t is page i * ntargets + t
+                    memcpy(targetbuf + (i * job->ntargets + t) * job->eeprom_info.page_size,
+                           readbuf + i * job->eeprom_info.page_size, job->eeprom_info.page_size);
+                targets[t] = job->eeprom_info;
+                targets[t].addr = job->targetcs[t];
+            }
+            if(ch341writeTargets(ctx, targetbuf, job->eepromsize, targets, job->ntargets) < 0) {
+                fprintf(stderr,"Failed to write [%d] images to [%s] EEPROMs\n", job->ntargets, job->eepromname);
+                goto out;
+            }
+            fprintf(msgout, "Wrote [%d] bytes to each of [%d] [%s] EEPROMs\n", job->eepromsize, job->ntargets, job->eepromname);
+            break;
+        case 'b': // blank check
+            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+            if((first = ch341blankCheck(ctx, readbuf, job->eepromsize, &job->eeprom_info)) < 0) {
+                fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", job->eepromsize, job->eepromname);
+                goto out;
+            }
+            if(first < job->eepromsize) {
+                fprintf(msgout, "[%s] EEPROM is not blank, first programmed byte at offset [%d]: %02hhX\n", job->eepromname, first, readbuf[first]);
+                exitcode = EXIT_NOT_BLANK;
+                goto out;
+            }
+            fprintf(msgout, "[%s] EEPROM is blank, all [%d] bytes are FF\n", job->eepromname, job->eepromsize);
+            break;
+        case 'e': // erase
+        case 'F': // fill
+            if((pageswritten = ch341fillEEPROM(ctx, job->fillpattern, job->filllen, job->eepromsize, &job->eeprom_info)) < 0) {
+                fprintf(stderr,"Failed to %s [%d] bytes of [%s] EEPROM\n", job->operation == 'e' ? "erase" : "fill", job->eepromsize, job->eepromname);
+                goto out;
+            }
+            npages = (job->eepromsize + job->eeprom_info.page_size - 1) / job->eeprom_info.page_size;
+            fprintf(msgout, "%s [%d] bytes of [%s] EEPROM, [%d] of [%d] pages already matched\n",
+                job->operation == 'e' ? "Erased" : "Filled", job->eepromsize, job->eepromname, npages - pageswritten, npages);
+            break;
+        default:
+            fprintf(stderr, "Unknown option\n");
+            goto out;
+        }
+
+    exitcode = EXIT_OK;
+    if(job->operation == 'r' && job->hash.type != HASH_NONE) {
+        snprintf(hashwhat, sizeof(hashwhat), "read from [%s] EEPROM", job->eepromname);
+        if(printChecksum(&job->hash, hashwhat, job->hashexpect) < 0)
+            exitcode = EXIT_MISMATCH;
+    }
+
+
+out:
+    free(chipbuf);
+    free(targetbuf);
+    free(dirty);
+    free(job->verify.ranges);
+    return exitcode;
+}
+
+static char version_msg[] =    
+    "ch341eeprom - an i2c EEPROM programming tool for the WCH CH341a IC\n" \
+    "Version " CH341TOOLVERSION  " copyright (c) 2011 asbokid <ballymunboy@gmail.com>\n\n" \
+    "This program comes with absolutely no warranty; This is free software,\n" \
+    "and you are welcome to redistribute it under certain conditions:\n" \
+    "GNU GPL v3 License: http://www.gnu.org/licenses/gpl.html\n";
+
+static char usage_msg[] = 
+    "Usage:\n" \
+    " -h, --help                  display this text\n" \
+    " -v, --verbose               verbose output\n" \
+    " -d, --debug                 debug output\n" \
+    " -s, --size                  size of EEPROM {24c01|24c02|24c04|24c08|24c16|24c32|24c64|24c128|24c256|24c512|24c1024}\n" \
+    " -b, --blank-check           check that the EEPROM is erased, stopping at the first programmed byte\n" \
+    " -e, --erase                 erase EEPROM (fill with 0xff), skipping pages that are already blank\n" \
+    " -F, --fill <pattern>        fill EEPROM with a repeating pattern of hex bytes (e.g. 00 or 55aa)\n" \
+    " -p, --speed                 i2c speed (low|fast|high) if different than standard which is default\n" \
+    " -c, --chip-select <value>   the part of the i2c address set by the chip select pins (default: 0)\n" \
+    " -q, --queue-depth <n>       number of 128 byte read blocks kept in flight (default: 8)\n" \
+    " -S, --sequential            read each region in a single sequential i2c transaction\n" \
+    " -P, --progress <mode>       progress output (auto|tty|machine|none), auto is tty only on a terminal\n" \
+    " -R, --range <off:len[:file]> read only this address range (repeatable), saved to file if given,\n" \
+    "                             otherwise at its offset in a sparse image written to the -r filename\n" \
+    " -w, --write  <filename>     write EEPROM with image from filename\n" \
+    " -t, --target <cs:filename>  write the image to the EEPROM at this chip select (repeatable, up to 8),\n" \
+    "                             pages are sent to each chip in turn while the others are busy writing\n" \
+    " -o, --offset <n>            write the image file to the EEPROM starting at address n\n" \
+    " -l, --length <n>            write only n bytes of the image file\n" \
+    " -x, --patch <off:hexbytes>  change the bytes at offset (repeatable), e.g. 0x1fa:0011223344ff\n" \
+    " -i, --diff                  only write the pages that differ from the EEPROM contents\n" \
+    " -D, --fixed-delay           wait a fixed delay (10ms by default) after each written page instead of ACK polling\n" \
+    " -B, --batch-pages <n>       send up to n pages, each with the fixed delay, per USB transfer\n" \
+    " -W, --twr <ms>              use a fixed delay of ms after each page\n" \
+    " -C, --calibrate             measure the write cycle time of the EEPROM and use it (plus margin) as the delay\n" \
+    " -T, --twr-cache <filename>  save the calibrated delay per EEPROM type, or reuse it when not calibrating\n" \
+    " -r, --read   <filename>     read EEPROM and save image to filename, - streams it to stdout\n" \
+    " -m, --mmap                  read straight into the memory-mapped image file\n" \
+    " -V, --verify <filename>     verify EEPROM contents against image in filename, together with\n" \
+    "                             -w of the same file each page is read back as it is written\n" \
+    " -a, --full-report           keep verifying past the first mismatch and list every differing range\n" \
+    " -k, --checksum <type>       print the crc32 or sha256 of the EEPROM as it is read, or of the image\n" \
+    "                             being written. without -r the EEPROM is only read to checksum it.\n" \
+    "                             type:value fails with exit status 3 unless the checksum is value\n" \
+    " -g, --gang                  write, verify, erase, fill, patch or blank check on every attached CH341\n" \
+    "                             at once and print a pass/fail table\n" \
+    " -L, --serve <socket>        keep the adapter claimed and run the jobs sent to this Unix socket\n" \
+    " -U, --client <socket>       hand the job on this command line to the server at this socket\n" \
+    " -J, --jobs <manifest>       run the jobs listed one per line, as options, in the manifest on every\n" \
+    "                             attached CH341, each adapter taking the next job when it is done\n" \
+    " -E, --emulate <dir[,opts]>  run on emulated CH341s with EEPROMs kept in files in dir instead of USB,\n" \
+    "                             opts: chip=24cXX (default -s), adapters=n, chips=n, latency=us, twr=us,\n" \
+    "                             fifo=keep\n\n" \
+    "Example: ch341eeprom -v -s 24c64 -w bootrom.bin\n";
+
+static struct option longopts[] = {
+    {"help",        no_argument,       0, 'h'},
+    {"verbose",     no_argument,       0, 'v'},
+    {"debug",       no_argument,       0, 'd'},
+    {"erase",       no_argument,       0, 'e'},
+    {"blank-check", no_argument,       0, 'b'},
+    {"fill",        required_argument, 0, 'F'},
+    {"size",        required_argument, 0, 's'},
+    {"speed",       required_argument, 0, 'p'},
+    {"chip-select", required_argument, 0, 'c'},
+    {"queue-depth", required_argument, 0, 'q'},
+    {"sequential",  no_argument,       0, 'S'},
+    {"progress",    required_argument, 0, 'P'},
+    {"range",       required_argument, 0, 'R'},
+    {"read",        required_argument, 0, 'r'},
+    {"mmap",        no_argument,       0, 'm'},
+    {"write",       required_argument, 0, 'w'},
+    {"target",      required_argument, 0, 't'},
+    {"offset",      required_argument, 0, 'o'},
+    {"length",      required_argument, 0, 'l'},
+    {"patch",       required_argument, 0, 'x'},
+    {"diff",        no_argument,       0, 'i'},
+    {"fixed-delay", no_argument,       0, 'D'},
+    {"batch-pages", required_argument, 0, 'B'},
+    {"twr",         required_argument, 0, 'W'},
+    {"calibrate",   no_argument,       0, 'C'},
+    {"twr-cache",   required_argument, 0, 'T'},
+    {"verify",      required_argument, 0, 'V'},
+    {"full-report", no_argument,       0, 'a'},
+    {"checksum",    required_argument, 0, 'k'},
+    {"gang",        no_argument,       0, 'g'},
+    {"serve",       required_argument, 0, 'L'},
+    {"client",      required_argument, 0, 'U'},
+    {"jobs",        required_argument, 0, 'J'},
+    {"emulate",     required_argument, 0, 'E'},
+    {0, 0, 0, 0}
+};
 
-    struct EEPROM eeprom_info;
-
-    static char version_msg[] =    
-        "ch341eeprom - an i2c EEPROM programming tool for the WCH CH341a IC\n" \
-        "Version " CH341TOOLVERSION  " copyright (c) 2011 asbokid <ballymunboy@gmail.com>\n\n" \
-        "This program comes with absolutely no warranty; This is free software,\n" \
-        "and you are welcome to redistribute it under certain conditions:\n" \
-        "GNU GPL v3 License: http://www.gnu.org/licenses/gpl.html\n";
-
-    static char usage_msg[] = 
-        "Usage:\n" \
-        " -h, --help                  display this text\n" \
-        " -v, --verbose               verbose output\n" \
-        " -d, --debug                 debug output\n" \
-        " -s, --size                  size of EEPROM {24c01|24c02|24c04|24c08|24c16|24c32|24c64|24c128|24c256|24c512|24c1024}\n" \
-        " -e, --erase                 erase EEPROM (fill with 0xff)\n" \
-        " -p, --speed                 i2c speed (low|fast|high) if different than standard which is default\n" \
-        " -c, --chip-select <value>   the part of the i2c address set by the chip select pins (default: 0)\n" \
-        " -w, --write  <filename>     write EEPROM with image from filename\n" \
-        " -r, --read   <filename>     read EEPROM and save image to filename\n" \
-        " -V, --verify <filename>     verify EEPROM contents against image in filename\n\n" \
-        "Example: ch341eeprom -v -s 24c64 -w bootrom.bin\n";
-
-    static struct option longopts[] = {
-        {"help",        no_argument,       0, 'h'},
-        {"verbose",     no_argument,       0, 'v'},
-        {"debug",       no_argument,       0, 'd'},
-        {"erase",       no_argument,       0, 'e'},
-        {"size",        required_argument, 0, 's'},
-        {"speed",       required_argument, 0, 'p'},
-        {"chip-select", required_argument, 0, 'c'},
-        {"read",        required_argument, 0, 'r'},
-        {"write",       required_argument, 0, 'w'},
-        {"verify",      required_argument, 0, 'V'},
-        {0, 0, 0, 0}
-    };
-
-    static int speed_table[] = {20, 100, 400, 750};
+static int speed_table[] = {20, 100, 400, 750};
+
+// fill in a job from the command line and check it, also sets the tuning
+// globals and the message streams. returns 0 if the job can run, 1 after
+// printing the help text, -1 on errors
+int32_t ch341parseJob(int argc, char **argv, struct ch341job *job) {
+    char *p;
+    int i;
 
     while (TRUE) {
         int32_t optidx = 0;
-        int8_t c = getopt_long(argc,argv,"hvdes:p:c:w:r:V:", longopts, &optidx);
+        int8_t c = getopt_long(argc,argv,"hvdbeF:s:p:c:q:SP:R:w:t:o:l:x:iDB:W:CT:r:mV:ak:gL:U:J:E:", longopts, &optidx);
         if (c == -1)
             break;
 
         switch (c) {
             case 'h': fprintf(stdout, "%s\n%s", version_msg, usage_msg);
-                      return 0;
-            case 'v': verbose = TRUE;
+                      return 1;
+            case 'v': job->verbose = TRUE;
                       break;
-            case 'd': debug = TRUE;
+            case 'd': job->debug = TRUE;
                       break;
-            case 's': if((eepromsize = parseEEPsize(optarg, &eeprom_info)) > 0)
-                        strncpy(eepromname, optarg, 10);
+            case 's': if((job->eepromsize = parseEEPsize(optarg, &job->eeprom_info)) > 0)
+                        strncpy(job->eepromname, optarg, 10);
                       break;
             case 'c':
-                     eeprom_info.addr = (uint8_t) atoi(optarg);
-                     if(eeprom_info.addr > 7) {
-                       fprintf(stderr, "chip select should probably be between 0 and 7 but continuing anyway");
+                     job->eeprom_info.addr = (uint8_t) atoi(optarg);
+                     if(job->eeprom_info.addr > 7) {
+                       fprintf(stderr, "chip select should probably be between 0 and 7 but continuing anyway\n");
                      }
+                     break;
             case 'p': if(strstr(optarg, "low"))
-                        speed = CH341_I2C_LOW_SPEED;
+                        job->speed = CH341_I2C_LOW_SPEED;
                       else if(strstr(optarg, "fast"))
-                        speed = CH341_I2C_FAST_SPEED;
+                        job->speed = CH341_I2C_FAST_SPEED;
                       else if(strstr(optarg, "high"))
-                        speed = CH341_I2C_HIGH_SPEED;
+                        job->speed = CH341_I2C_HIGH_SPEED;
                       else
-                        speed = CH341_I2C_STANDARD_SPEED;
+                        job->speed = CH341_I2C_STANDARD_SPEED;
+                      break;
+            case 'q': job->tuning.readqueuedepth = (uint32_t) atoi(optarg);
+                      if(job->tuning.readqueuedepth < 1 || job->tuning.readqueuedepth > MAX_READ_QUEUE_DEPTH) {
+                        fprintf(stderr, "Queue depth should be between 1 and %d\n", MAX_READ_QUEUE_DEPTH);
+                        return -1;
+                      }
+                      break;
+            case 'S': job->tuning.readsequential = TRUE;
+                      break;
+            case 'P': if((job->tuning.progressmode = ch341progressParseMode(optarg)) == (uint8_t) -1) {
+                        fprintf(stderr, "Unknown progress mode [%s]\n", optarg);
+                        return -1;
+                      }
                       break;
-            case 'e': if(!operation)
-                        operation = 'e';
+            case 'R': if(job->nranges == MAX_READ_RANGES) {
+                        fprintf(stderr, "No more than %d ranges can be read at once\n", MAX_READ_RANGES);
+                        return -1;
+                      }
+                      if(parseRange(optarg, &job->ranges[job->nranges], &job->rangefiles[job->nranges]) < 0) {
+                        fprintf(stderr, "Invalid range [%s], expected offset:length[:filename]\n", optarg);
+                        return -1;
+                      }
+                      job->nranges++;
+                      break;
+            case 'b':
+            case 'e': if(!job->operation)
+                        job->operation = c;
                       else {
                         fprintf(stderr, "Conflicting command line options\n");
-                        goto shutdown;
+                        return -1;
                       }
                       break;
-            case 'r': if(!operation) {
-                        operation = 'r';
-                        filename = (char *) malloc(strlen(optarg)+1);
-                        strcpy(filename, optarg);
+            case 'F': if(!job->operation)
+                        job->operation = 'F';
+                      else {
+                        fprintf(stderr, "Conflicting command line options\n");
+                        return -1;
+                      }
+                      if((job->filllen = parseFill(optarg, job->fillpattern, EEPROM_MAX_PAGE_SZ)) < 0) {
+                        fprintf(stderr, "Invalid fill pattern [%s], expected hex bytes\n", optarg);
+                        return -1;
+                      }
+                      break;
+            case 'r': if(!job->operation) {
+                        job->operation = 'r';
+                        job->filename = (char *) malloc(strlen(optarg)+1);
+                        strcpy(job->filename, optarg);
                       } else {
                         fprintf(stderr, "Conflicting command line options\n");
-                        goto shutdown;
+                        return -1;
                       }
                       break;
-            case 'w': if(!operation) {
-                        operation = 'w';
-                        filename = (char *) malloc(strlen(optarg)+1);
-                        strcpy(filename, optarg);
+            case 'm': job->usemmap = TRUE;
+                      break;
+            case 'w': if(job->operation == 'V' && !strcmp(job->filename, optarg)) {
+                        job->operation = 'w';   // write with readback verify
+                        job->tuning.writeverify = TRUE;
+                      } else if(!job->operation) {
+                        job->operation = 'w';
+                        job->filename = (char *) malloc(strlen(optarg)+1);
+                        strcpy(job->filename, optarg);
                       } else {
                         fprintf(stderr, "Conflicting command line options\n");
-                        goto shutdown;
+                        return -1;
                       }  
                       break;
-            case 'V': if(!operation) {
-                        operation = 'V';
-                        filename = (char *) malloc(strlen(optarg)+1);
-                        strcpy(filename, optarg);
+            case 't': if(job->operation && job->operation != 't') {
+                        fprintf(stderr, "Conflicting command line options\n");
+                        return -1;
+                      }
+                      if(job->ntargets == MAX_TARGETS) {
+                        fprintf(stderr, "No more than %d targets can be written at once\n", MAX_TARGETS);
+                        return -1;
+                      }
+                      if(parseTarget(optarg, &job->targetcs[job->ntargets], &job->targetfiles[job->ntargets]) < 0) {
+                        fprintf(stderr, "Invalid target [%s], expected chipselect:filename with a chip select of 0 to 7\n", optarg);
+                        return -1;
+                      }
+                      for(i=0; i < job->ntargets; i++)
+                        if(job->targetcs[i] == job->targetcs[job->ntargets]) {
+                          fprintf(stderr, "Chip select [%d] is targeted twice\n", job->targetcs[i]);
+                          return -1;
+                        }
+                      job->operation = 't';
+                      job->ntargets++;
+                      break;
+            case 'o': job->writeoffset = strtoul(optarg, NULL, 0);
+                      job->partialwrite = TRUE;
+                      break;
+            case 'l': job->writelength = strtoul(optarg, NULL, 0);
+                      job->partialwrite = TRUE;
+                      break;
+            case 'x': if(job->npatches == MAX_PATCHES) {
+                        fprintf(stderr, "No more than %d patches can be applied at once\n", MAX_PATCHES);
+                        return -1;
+                      }
+                      if(parsePatch(optarg, &job->patches[job->npatches], job->patchdata[job->npatches], MAX_PATCH_SZ) < 0) {
+                        fprintf(stderr, "Invalid patch [%s], expected offset:hexbytes of up to %d bytes\n", optarg, MAX_PATCH_SZ);
+                        return -1;
+                      }
+                      job->npatches++;
+                      break;
+            case 'i': job->diffwrite = TRUE;
+                      break;
+            case 'D': job->tuning.writeackpoll = FALSE;
+                      break;
+            case 'W': job->tuning.writecycledelay = (uint32_t) atoi(optarg);
+                      if(job->tuning.writecycledelay < 1 || job->tuning.writecycledelay > MAX_WRITE_CYCLE_DELAY) {
+                        fprintf(stderr, "Write cycle delay should be between 1 and %dms\n", MAX_WRITE_CYCLE_DELAY);
+                        return -1;
+                      }
+                      job->tuning.writeackpoll = FALSE;
+                      break;
+            case 'C': job->calibrate = TRUE;
+                      break;
+            case 'T': job->twrcache = optarg;
+                      break;
+            case 'B': job->tuning.writebatch = (uint32_t) atoi(optarg);
+                      if(job->tuning.writebatch < 1 || job->tuning.writebatch > MAX_WRITE_BATCH) {
+                        fprintf(stderr, "Pages per batch should be between 1 and %d\n", MAX_WRITE_BATCH);
+                        return -1;
+                      }
+                      break;
+            case 'V': if(job->operation == 'w' && !strcmp(job->filename, optarg))
+                        job->tuning.writeverify = TRUE;     // write with readback verify
+                      else if(!job->operation) {
+                        job->operation = 'V';
+                        job->filename = (char *) malloc(strlen(optarg)+1);
+                        strcpy(job->filename, optarg);
                       } else {
                         fprintf(stderr, "Conflicting command line options\n");
-                        goto shutdown;
+                        return -1;
+                      }
+                      break;
+            case 'a': job->verify.fullreport = TRUE;
+                      break;
+            case 'g': job->gang = TRUE;
+                      break;
+            case 'L': job->serve = optarg;
+                      break;
+            case 'U': job->client = optarg;
+                      break;
+            case 'J': job->manifest = optarg;
+                      break;
+            case 'E': if(ch341emuParse(optarg, &job->emu) < 0)
+                        return -1;
+                      job->emulate = TRUE;
+                      break;
+            case 'k': if((p = strchr(optarg, ':'))) {     // type:expected checksum
+                        *p++ = 0;
+                        if(strlen(p) >= HASH_MAX_HEX) {
+                            fprintf(stderr, "Expected checksum [%s] is too long\n", p);
+                            return -1;
+                        }
+                        strcpy(job->hashexpect, p);
                       }
+                      if((i = ch341hashParseType(optarg)) < 0) {
+                        fprintf(stderr, "Unknown checksum type [%s], use crc32 or sha256\n", optarg);
+                        return -1;
+                      }
+                      ch341hashInit(&job->hash, i);
                       break;
             default :  
             case '?': fprintf(stdout, "%s", version_msg);
                       fprintf(stderr, "%s", usage_msg);
-                      goto shutdown;
+                      return -1;
         }
     }
 
-    debugout = (debug == TRUE) ? stdout : fopen("/dev/null","w");
-    verbout = (verbose == TRUE) ? stdout : fopen("/dev/null","w");
+    job->tostdout = (job->operation == 'r' && job->filename && !strcmp(job->filename, "-"));
+    msgout = job->tostdout ? stderr : stdout;       // stdout carries the image when streaming
+    if(!devnull)                                    // opened once, the server parses a job per request
+        devnull = fopen("/dev/null","w");
+    debugout = (job->debug == TRUE) ? msgout : devnull;
+    verbout = (job->verbose == TRUE) ? msgout : devnull;
     fprintf(debugout, "Debug Enabled\n"); 
 
-    if(!operation) {        
+    if(job->manifest && (job->operation || job->gang || job->serve)) {
+        fprintf(stderr, "Conflicting command line options\n");
+        return -1;
+    }
+
+    if(job->emulate && !job->emu.chip && job->eepromname[0])
+        job->emu.chip = job->eepromname;            // emulate the EEPROM the job is for
+    if(job->emulate && !job->emu.chip) {
+        fprintf(stderr, "Give the EEPROM to emulate with -s or chip=\n");
+        return -1;
+    }
+
+    if(job->serve || job->manifest)                 // the jobs come from the clients or the manifest
+        return 0;
+
+    if(!job->operation && job->nranges)              // ranges that all name their own file
+        job->operation = 'r';
+
+    if(!job->operation && job->npatches)
+        job->operation = 'x';
+
+    if(!job->operation && job->hash.type != HASH_NONE) // read only to checksum the EEPROM
+        job->operation = 'r';
+
+    if(!job->operation && job->calibrate)            // only measure, e.g. to fill the cache
+        job->operation = 'C';
+
+    if(!job->operation) {        
         fprintf(stderr, "%s\n%s", version_msg, usage_msg);
-        goto shutdown;
+        return -1;
     } 
     
-    if(eepromsize <= 0) {
+    if(job->eepromsize <= 0) {
         fprintf(stderr, "Invalid EEPROM size\n");
-        goto shutdown;
+        return -1;
     }
 
-    readbuf = (uint8_t *) malloc(MAX_EEPROM_SIZE);   // space to store loaded EEPROM
-    if(!readbuf) {
-        fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
-        goto shutdown;
+    if(job->nranges && job->operation != 'r') {
+        fprintf(stderr, "Address ranges can only be used when reading\n");
+        return -1;
     }
 
-    if(!(devHandle = ch341configure(USB_LOCK_VENDOR, USB_LOCK_PRODUCT))) {
-        fprintf(stderr, "Couldnt configure USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
-        goto shutdown;
+    if(job->usemmap && (job->operation != 'r' || job->nranges || job->tostdout || !job->filename)) {
+        fprintf(stderr, "Memory-mapped output only applies to reading the whole EEPROM to a file\n");
+        return -1;
     }
-    fprintf(verbout, "Configured USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
 
-    if(ch341setstream(devHandle, speed) < 0) {
-        fprintf(stderr, "Couldnt set i2c bus speed\n");
-        goto shutdown;
+    if(job->operation == 'F' && job->eeprom_info.page_size % job->filllen) {
+        fprintf(stderr, "Fill pattern of [%d] bytes doesnt evenly divide the [%d] byte page of [%s] EEPROM\n", job->filllen, job->eeprom_info.page_size, job->eepromname);
+        return -1;
     }
-    fprintf(verbout, "Set i2c bus speed to [%dkHz]\n", speed_table[speed]);
 
-    switch(operation) {
-        case 'r':   // read
-            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+    if(job->partialwrite && job->operation != 'w') {
+        fprintf(stderr, "Offset and length only apply to writing an image\n");
+        return -1;
+    }
 
-            if(ch341readEEPROM(devHandle, readbuf, eepromsize, &eeprom_info) < 0) {
-                fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", eepromsize, eepromname);
-                goto shutdown;
-            }
-            fprintf(stdout, "Read [%d] bytes from [%s] EEPROM\n", eepromsize, eepromname);
-            for(i=0;i<eepromsize;i++) {
-                if(!(i%16))
-                    fprintf(debugout, "\n%04x: ", i);
-                fprintf(debugout, "%02x ", readbuf[i]);
-            }
-            fprintf(debugout, "\n");
+    if(job->npatches && job->operation != 'x') {
+        fprintf(stderr, "Patches cant be combined with other operations\n");
+        return -1;
+    }
 
-            if(!(fp=fopen(filename, "wb"))) {
-                fprintf(stderr, "Couldnt open file [%s] for writing\n", filename);
-                goto shutdown;
-            }
+    if(job->partialwrite && (job->writeoffset >= job->eepromsize || job->writelength > job->eepromsize - job->writeoffset)) {
+        fprintf(stderr, "Offset [0x%x] and length [0x%x] are outside the [%s] EEPROM\n", job->writeoffset, job->writelength, job->eepromname);
+        return -1;
+    }
 
-            fwrite(readbuf, 1, eepromsize, fp);
-            if(ferror(fp)) {
-                fprintf(stderr, "Error writing file [%s]\n", filename);
-                if(fp)
-                    fclose(fp);
-                goto shutdown;
-            }
-            fclose(fp);
-            fprintf(stdout, "Wrote [%d] bytes to file [%s]\n", eepromsize, filename);
-            break;
-        case 'V':   // verify
-            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
+    for(i=0; i < job->npatches; i++) {
+        if(job->patches[i].offset + job->patches[i].length > job->eepromsize || job->patches[i].offset + job->patches[i].length < job->patches[i].offset) {
+            fprintf(stderr, "Patch at [0x%x] is outside the [%s] EEPROM\n", job->patches[i].offset, job->eepromname);
+            return -1;
+        }
+        job->patchbytes += job->patches[i].length;
+    }
 
-            if(ch341readEEPROM(devHandle, readbuf, eepromsize, &eeprom_info) < 0) {
-                fprintf(stderr, "Couldnt read [%d] bytes from [%s] EEPROM\n", eepromsize, eepromname);
-                goto shutdown;
-            }
-            fprintf(stdout, "Read [%d] bytes from [%s] EEPROM\n", eepromsize, eepromname);
-            for(i=0;i<eepromsize;i++) {
-                if(!(i%16))
-                    fprintf(debugout, "\n%04x: ", i);
-                fprintf(debugout, "%02x ", readbuf[i]);
-            }
-            fprintf(debugout, "\n");
+    if(job->diffwrite && job->operation != 'w') {
+        fprintf(stderr, "Differential programming only applies to writing an image\n");
+        return -1;
+    }
 
-            if(!(fp=fopen(filename, "rb"))) {
-                fprintf(stderr, "Couldnt open file [%s] for reading\n", filename);
-                goto shutdown;
-            }
+    if(job->hash.type != HASH_NONE && (job->nranges || (job->operation != 'r' && job->operation != 'w'))) {
+        fprintf(stderr, "Checksums only apply to reading the whole EEPROM or to the image being written\n");
+        return -1;
+    }
 
-            verifybuf = mmap(NULL, eepromsize, PROT_READ, MAP_PRIVATE, fileno(fp), 0);
-            if(!verifybuf) {
-                fprintf(stderr, "Error mapping file [%s]\n", filename);
-                if(fp)
-                    fclose(fp);
-                goto shutdown;
-            }
+    if(*job->hashexpect && strlen(job->hashexpect) != (job->hash.type == HASH_SHA256 ? 64 : 8)) {
+        fprintf(stderr, "Expected %s checksum [%s] should be [%d] hex digits\n", ch341hashName(job->hash.type), job->hashexpect, job->hash.type == HASH_SHA256 ? 64 : 8);
+        return -1;
+    }
 
-	    for(i=0;i<eepromsize;i++) {
-                if(readbuf[i]!=verifybuf[i]) {
-                    verify_failed = TRUE;
-                    break;
-                }
-            }
-            if(verify_failed)
-                fprintf(stdout, "Verification against file [%s] failed at offset [%d], EEPROM: %02hhX, file: %02hhX\n", filename, i, readbuf[i], verifybuf[i]);
-            else
-                fprintf(stdout, "Verified [%d] bytes against file [%s]\n", eepromsize, filename);
+    if(job->gang && !strchr("wtVeFxb", job->operation)) {
+        fprintf(stderr, "Gang mode only applies to writing, verifying, erasing, filling, patching and blank checks\n");
+        return -1;
+    }
 
-            munmap(verifybuf, eepromsize);
-            fclose(fp);
-            break;
-        case 'w':   // write
-            if(!(fp=fopen(filename, "rb"))) {
-                fprintf(stderr, "Couldnt open file [%s] for reading\n", filename);
-                goto shutdown;
-            }
-            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
-            bytesread = fread(readbuf, 1, MAX_EEPROM_SIZE, fp);
-            if(ferror(fp)) {
-                fprintf(stderr, "Error reading file [%s]\n", filename);
-                if(fp)
-                    fclose(fp);
-                goto shutdown;
-            }
-            fclose(fp);
-            fprintf(stdout, "Read [%d] bytes from file [%s]\n", bytesread, filename);
-        
-            if(bytesread < eepromsize)
-                fprintf(stdout, "Padded to [%d] bytes for [%s] EEPROM\n", eepromsize, eepromname);
+    if(job->gang && job->calibrate) {
+        fprintf(stderr, "Calibrate on a single adapter, gang mode takes the delay from -W or -T\n");
+        return -1;
+    }
 
-            if(bytesread > eepromsize)
-                fprintf(stdout, "Truncated to [%d] bytes for [%s] EEPROM\n", eepromsize, eepromname);
+    if(job->tostdout && job->nranges) {
+        fprintf(stderr, "Address ranges cant be streamed to stdout\n");
+        return -1;
+    }
 
-            if(ch341writeEEPROM(devHandle, readbuf, eepromsize, &eeprom_info) < 0) {
-                fprintf(stderr,"Failed to write [%d] bytes from [%s] to [%s] EEPROM\n", eepromsize, filename, eepromname);
-                goto shutdown;
-            }
-            fprintf(stdout, "Wrote [%d] bytes to [%s] EEPROM\n", eepromsize, eepromname);
-            break;
-        case 'e': // erase
-            memset(readbuf, 0xff, MAX_EEPROM_SIZE);
-            if(ch341writeEEPROM(devHandle, readbuf, eepromsize, &eeprom_info) < 0) {
-                fprintf(stderr,"Failed to erase [%d] bytes of [%s] EEPROM\n", eepromsize, eepromname);
-                goto shutdown;
-            }
-            fprintf(stdout, "Erased [%d] bytes of [%s] EEPROM\n", eepromsize, eepromname);
-            break;
-        default:
-            fprintf(stderr, "Unknown option\n");
+    for(i=0; i < job->nranges; i++) {
+        if(job->ranges[i].offset + job->ranges[i].length > job->eepromsize || job->ranges[i].offset + job->ranges[i].length < job->ranges[i].offset) {
+            fprintf(stderr, "Range [0x%x:0x%x] is outside the [%s] EEPROM\n", job->ranges[i].offset, job->ranges[i].length, job->eepromname);
+            return -1;
+        }
+        if(!job->rangefiles[i] && !job->filename) {
+            fprintf(stderr, "Range [0x%x:0x%x] has no filename and no image was given with -r\n", job->ranges[i].offset, job->ranges[i].length);
+            return -1;
+        }
+        job->rangebytes += job->ranges[i].length;
+    }
+
+    return 0;
+}
+
+// calibrate the write cycle time, or take it from the cache, as the job asks
+// returns -1 if calibration failed
+int32_t ch341setupTWR(struct ch341job *job, struct ch341ctx *ctx) {
+    int32_t twr;
+
+    if(job->calibrate) {
+        if((twr = ch341calibrateTWR(ctx, &job->eeprom_info, speed_table[job->speed])) < 0) {
+            fprintf(stderr, "Couldnt measure the write cycle time of [%s] EEPROM\n", job->eepromname);
+            return -1;
+        }
+        job->tuning.writecycledelay = ch341twrDelay(twr);
+        job->tuning.writeackpoll = FALSE;
+        fprintf(msgout, "Measured a write cycle time of [%dms] on [%s] EEPROM, waiting [%dms] per page\n", twr, job->eepromname, job->tuning.writecycledelay);
+        if(job->twrcache && ch341twrCacheSave(job->twrcache, job->eeprom_info.name, job->tuning.writecycledelay) == 0)
+            fprintf(verbout, "Saved the delay for [%s] to [%s]\n", job->eeprom_info.name, job->twrcache);
+    } else if(job->twrcache && job->tuning.writeackpoll && (twr = ch341twrCacheLoad(job->twrcache, job->eeprom_info.name)) > 0) {
+        job->tuning.writecycledelay = MIN(twr, MAX_WRITE_CYCLE_DELAY);
+        job->tuning.writeackpoll = FALSE;
+        fprintf(verbout, "Using the [%dms] delay cached for [%s] in [%s]\n", job->tuning.writecycledelay, job->eeprom_info.name, job->twrcache);
+    }
+    return 0;
+}
+
+// a job with every option at its default
+void ch341jobInit(struct ch341job *job) {
+    memset(job, 0, sizeof(struct ch341job));
+    job->fillpattern[0] = 0xff;
+    job->filllen = 1;
+    job->speed = CH341_I2C_STANDARD_SPEED;
+    ch341tuningDefaults(&job->tuning);
+}
+
+int main(int argc, char **argv) {
+    struct ch341ctx *ctx = NULL;
+    struct ch341job job;
+    uint8_t *readbuf = NULL;
+    int32_t exitcode = EXIT_ERROR, ret;
+
+    ch341jobInit(&job);
+    if((ret = ch341parseJob(argc, argv, &job)) != 0) {
+        exitcode = ret > 0 ? EXIT_OK : EXIT_ERROR;
+        goto shutdown;
+    }
+
+    if(job.client) {                                // the server does the work, this only hands it the job
+        exitcode = ch341clientRun(job.client, argc, argv);
+        goto shutdown;
+    }
+
+    readbuf = (uint8_t *) malloc(MAX_EEPROM_SIZE);   // space to store loaded EEPROM
+    if(!readbuf) {
+        fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
+        goto shutdown;
+    }
+
+    signal(SIGINT, sigInterrupt);                   // let a transfer in progress finish cleanly
+    signal(SIGTERM, sigInterrupt);
+
+    if(job.serve) {                                 // claims the adapter itself and keeps it
+        exitcode = ch341serve(&job, readbuf);
+        goto shutdown;
+    }
+
+    if(!(ctx = ch341ctxNew(NULL))) {
+        fprintf(stderr, "Couldnt allocate the adapter context\n");
+        goto shutdown;
+    }
+    ch341ctxSetOutput(ctx, msgout, verbout, debugout);
+    ch341ctxSetCancel(ctx, &ch341interrupted);
+    if(job.emulate && ch341ctxEmulate(ctx, &job.emu) < 0)
+        goto shutdown;
+
+    if(job.manifest) {                              // each job of it sets up the adapter it lands on
+        exitcode = ch341jobsRun(&job, ctx);
+        goto shutdown;
+    }
+
+    if(!job.gang) {                                 // gang mode opens every adapter in ch341gangRun()
+        if(ch341configure(ctx, USB_LOCK_VENDOR, USB_LOCK_PRODUCT) < 0) {
+            fprintf(stderr, "Couldnt configure USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+            goto shutdown;
+        }
+        fprintf(verbout, "Configured USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+
+        if(ch341setstream(ctx, job.speed) < 0) {
+            fprintf(stderr, "Couldnt set i2c bus speed\n");
             goto shutdown;
         }
+        fprintf(verbout, "Set i2c bus speed to [%dkHz]\n", speed_table[job.speed]);
+    }
+
+    if(ch341setupTWR(&job, ctx) < 0)
+        goto shutdown;
+
+    if(job.gang)
+        exitcode = ch341gangRun(&job, ctx, job.speed);
+    else
+        exitcode = ch341runJob(&job, ctx, readbuf);
+
 
 shutdown:
     if(readbuf)
         free(readbuf);
-    if(filename)
-        free(filename);
-    if(devHandle) {
-        libusb_release_interface(devHandle, DEFAULT_INTERFACE);
-        fprintf(debugout, "Released device interface [%d]\n", DEFAULT_INTERFACE);
-        libusb_close(devHandle);
-        fprintf(verbout, "Closed USB device\n");
-        libusb_exit(NULL);
-    }
-    return 0;
+    if(job.filename)
+        free(job.filename);
+    if(ctx)
+        ch341ctxFree(ctx);                          // releases and closes the adapter
+    return exitcode;
 }
-
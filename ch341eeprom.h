@@ -18,11 +18,42 @@
 
 #define DEFAULT_CONFIGURATION       0x01
 #define DEFAULT_TIMEOUT             300    // 300mS for USB timeouts
+#define DRAIN_TIMEOUT               20     // ms the CH341 gets to return what cancelled reads still owe
 
 #define IN_BUF_SZ                   0x100
-#define EEPROM_WRITE_BUF_SZ         0x2b   // only for 24c64 / 24c32 ??
+#define EEPROM_MAX_PAGE_SZ          0x100  // 24c1024
+#define EEPROM_WRITE_BUF_SZ         0x180  // one max size page in 28 byte frames, padded to 32 byte packets
 #define EEPROM_READ_BULKIN_BUF_SZ   0x20
 #define EEPROM_READ_BULKOUT_BUF_SZ  0x65
+#define EEPROM_READ_BLOCK_SZ        0x80   // bytes fetched by one BULK OUT read command
+#define EEPROM_READ_PKTS_PER_BLOCK  (EEPROM_READ_BLOCK_SZ / EEPROM_READ_BULKIN_BUF_SZ)
+
+#define DEFAULT_READ_QUEUE_DEPTH    8      // read blocks kept in flight
+#define MAX_READ_QUEUE_DEPTH        64
+#define READ_RANGE_MERGE_GAP        0x20   // read through gaps up to this size rather than restart
+#define MAX_READ_RANGES             64
+#define MAX_GANG_ADAPTERS           32     // CH341s driven at once in gang mode
+#define SERVE_BACKLOG               16     // clients queued while a job runs
+#define SERVE_MAX_REQUEST           0x2000 // working directory and arguments of one job
+#define SERVE_MAX_ARGS              256
+#define MANIFEST_MAX_LINE           0x1000 // options of one job in a --jobs manifest
+#define MAX_PATCHES                 64
+#define MAX_PATCH_SZ                0x100  // bytes in one --patch
+#define MAX_TARGETS                 8      // --target chips written interleaved, one per chip select
+
+#define WRITE_CYCLE_DELAY           10     // ms waited after each page when not ACK polling
+#define MAX_WRITE_CYCLE_DELAY       200    // fits one stream frame of 15ms steps
+#define CALIBRATE_SAMPLES           5      // write cycles timed on the scratch page
+#define CALIBRATE_MAX_TWR           20     // ms of 1ms spaced polls after each of them
+#define CALIBRATE_MARGIN            1      // ms added to a measured tWR, at least a quarter of it
+#define CALIBRATE_CACHE_ENTRIES     32
+#define ACK_POLL_TIMEOUT            25     // ms a device may stay busy after a page write
+#define CH341_MAX_BULK_OUT_SZ       0x400  // CH341 input buffer (mDEFAULT_BUFFER_LEN), caps a batched write
+#define MAX_WRITE_BATCH             32
+#define WRITE_QUEUE_DEPTH           2      // write transfers queued when the CH341 does the waiting
+#define WRITE_VERIFY_RETRIES        3      // rewrites of a page whose readback differs
+#define WRITE_VERIFY_PKTS           (CH341_MAX_BULK_OUT_SZ / mCH341_PACKET_LENGTH)
+#define CH341_PKT_ALIGN(n)          (((n) + mCH341_PACKET_LENGTH - 1) & ~(mCH341_PACKET_LENGTH - 1))
 
 /* Based on (closed-source) DLL V1.9 for USB by WinChipHead (c) 2005.
    Supports USB chips: CH341, CH341A
@@ -340,37 +371,447 @@
 #define TRUE    1
 #define FALSE   0
 
-struct EEPROM {
-    char *name;
-    uint32_t size;
-    uint16_t page_size;
-    uint8_t addr_size; // Length of addres in bytes
-    uint8_t addr; // value of the (up to) three EEPROM address select pins
-};
-
 const static struct EEPROM eepromlist[] = {
   { "24c01",   128,     8,  1, 0x00}, // 16 pages of 8 bytes each = 128 bytes
   { "24c02",   256,     8,  1, 0x00}, // 32 pages of 8 bytes each = 256 bytes
-  { "24c04",   512,    16,  1, 0x01}, // 32 pages of 16 bytes each = 512 bytes
-  { "24c08",   1024,   16,  1, 0x03}, // 64 pages of 16 bytes each = 1024 bytes
-  { "24c16",   2048,   16,  1, 0x07}, // 128 pages of 16 bytes each = 2048 bytes
+  { "24c04",   512,    16,  1, 0x00}, // 32 pages of 16 bytes each = 512 bytes
+  { "24c08",   1024,   16,  1, 0x00}, // 64 pages of 16 bytes each = 1024 bytes
+  { "24c16",   2048,   16,  1, 0x00}, // 128 pages of 16 bytes each = 2048 bytes
   { "24c32",   4096,   32,  2, 0x00}, // 32kbit = 4kbyte
   { "24c64",   8192,   32,  2, 0x00},
-  { "24c128",  16384,  32/*64*/,  2, 0x00},
-  { "24c256",  32768,  32/*64*/,  2, 0x00},
-  { "24c512",  65536,  32/*128*/, 2, 0x00},
-  { "24c1024", 131072, 32/*128*/, 2, 0x01},
+  { "24c128",  16384,  64,  2, 0x00},
+  { "24c256",  32768,  64,  2, 0x00},
+  { "24c512",  65536,  128, 2, 0x00},
+  { "24c1024", 131072, 256, 2, 0x00},
   { 0, 0, 0, 0 }
 };
 
-extern uint8_t *readbuf;
+#define PROGRESS_INTERVAL           0.25   // seconds between progress reports
+
+struct ch341progress {
+    FILE *out;
+    char *label;
+    char *op;
+    uint32_t total;
+    uint8_t mode;
+    double start;
+    double last;            // time of the last report
+};
+
+// blank scan ahead of a fill: which pages differ from the fill template
+struct ch341fillscan {
+    uint8_t *page;          // one page of the fill pattern
+    uint16_t page_size;
+    uint8_t *dirty;         // one flag per page
+};
+
+#define EXIT_OK                     0      // exit status of the tool
+#define EXIT_ERROR                  1
+#define EXIT_NOT_BLANK              2      // --blank-check found programmed bytes
+#define EXIT_MISMATCH               3      // --verify found differences
+
+#define HASH_NONE                   0      // --checksum types
+#define HASH_CRC32                  1
+#define HASH_SHA256                 2
+#define HASH_MAX_HEX                65     // sha256 in hex plus the terminator
+
+// running checksum of the data read or written
+struct ch341hash {
+    uint8_t type;
+    uint32_t crc;
+    uint32_t h[8];          // sha256 state
+    uint8_t block[64];      // sha256 input not yet compressed
+    uint32_t fill;
+    uint64_t bytes;
+};
+
+// block callback chain of a whole EEPROM read: checksum, then the read mode's own callback
+struct ch341readsink {
+    struct ch341hash *hash;
+    ch341blockcb next;
+    void *arg;
+};
+
+// one operation as given on the command line, run on one adapter or copied to each gang worker
+struct ch341job {
+    char operation;
+    char *filename;
+    char eepromname[12];
+    struct EEPROM eeprom_info;
+    int32_t eepromsize;
+    struct ch341range ranges[MAX_READ_RANGES];
+    char *rangefiles[MAX_READ_RANGES];
+    uint32_t nranges;
+    uint32_t rangebytes;
+    uint8_t usemmap;
+    uint8_t tostdout;
+    uint8_t diffwrite;
+    uint8_t partialwrite;
+    uint8_t fillpattern[EEPROM_MAX_PAGE_SZ];
+    int32_t filllen;
+    uint32_t writeoffset;
+    uint32_t writelength;
+    struct ch341range patches[MAX_PATCHES];
+    uint8_t patchdata[MAX_PATCHES][MAX_PATCH_SZ];
+    uint32_t npatches;
+    uint32_t patchbytes;
+    uint8_t targetcs[MAX_TARGETS];
+    char *targetfiles[MAX_TARGETS];
+    uint32_t ntargets;
+    struct ch341verify verify;
+    struct ch341hash hash;
+    char hashexpect[HASH_MAX_HEX];  // checksum the image or EEPROM has to have, empty if any
+    uint32_t speed;         // CH341_I2C_ speed index
+    struct ch341tuning tuning;
+    uint8_t debug;
+    uint8_t verbose;
+    uint8_t gang;
+    uint8_t calibrate;
+    char *twrcache;
+    char *serve;            // socket to serve jobs on
+    char *client;           // socket of the server to hand the job to
+    char *manifest;         // file of jobs to share out among the adapters
+    struct ch341emuconfig emu;  // CH341s and EEPROMs to emulate instead of USB
+    uint8_t emulate;
+};
+
+// how a context reaches its adapter: libusb for real CH341s, or the emulator.
+// the engine fills in and calls back libusb_transfers either way
+struct ch341transport {
+    int32_t (*open)(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct libusb_device_handle **handles, int32_t max);
+    void (*close)(struct ch341ctx *ctx);                       // release and close ctx->devHandle
+    void (*release)(struct ch341ctx *ctx);                     // whatever ctx holds of the transport itself
+    void (*location)(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address);
+    int (*bulk)(struct ch341ctx *ctx, uint8_t endpoint, uint8_t *data, int len, int *actual, uint32_t timeout);
+    struct libusb_transfer *(*alloc)(void);
+    void (*free)(struct libusb_transfer *transfer);
+    int (*submit)(struct libusb_transfer *transfer);
+    int (*cancel)(struct libusb_transfer *transfer);
+    int (*events)(struct ch341ctx *ctx, struct timeval *tv, int *completed);
+};
+
+// one adapter: the library state behind the opaque handle of libch341eeprom.h
+struct ch341ctx {
+    struct libusb_device_handle *devHandle;
+    struct ch341transport *transport;
+    struct ch341emu *emu;   // the emulator, shared with the contexts of the adapters it opened
+    struct libusb_context *usb; // libusb context of this adapter alone, so only its own thread runs its callbacks
+    struct ch341tuning tuning;
+    FILE *msgout;           // messages and progress
+    FILE *verbout;          // verbose and debug output, devnull unless asked for
+    FILE *debugout;
+    FILE *devnull;
+    volatile sig_atomic_t *cancel;  // stops the transfers once set, e.g. from a signal handler
+    volatile sig_atomic_t cancelled;// what cancel points to unless the caller has its own flag
+};
+
+// one adapter of a gang and the result of its copy of the job
+struct ch341gangworker {
+    pthread_t thread;
+    struct ch341ctx *ctx;
+    uint8_t bus;
+    uint8_t address;
+    uint32_t speed;
+    struct ch341job job;
+    uint8_t *readbuf;
+    int32_t status;
+    double seconds;
+};
+
+#define EMU_IDLE                    0      // i2c state of an emulated EEPROM
+#define EMU_ADDRESS                 1      // taking the data address of a write
+#define EMU_WRITE                   2      // filling its page buffer
+#define EMU_READ                    3
+#define EMU_LATENCY_US              1000   // USB round trip, one full speed frame
+#define EMU_TWR_US                  5000   // typical 24Cxx write cycle
+
+// one BULK IN packet of an emulated CH341, waiting for a transfer to take it
+struct ch341emupacket {
+    uint8_t data[mCH341_PACKET_LENGTH];
+    uint32_t len;
+    double ready;           // when it can reach the host
+    struct ch341emupacket *next;
+};
+
+// a submitted transfer of the emulator: done, or an IN waiting for a packet
+struct ch341emupending {
+    struct libusb_transfer *transfer;
+    double ready;           // when it completes, or times out while waiting
+    struct ch341emupending *next;
+};
+
+// one emulated 24Cxx
+struct ch341emuchip {
+    uint8_t *mem;           // the file of the EEPROM, mapped
+    struct EEPROM info;
+    uint8_t cs;             // value of its chip select pins
+    uint8_t blockbits;      // device address bits taken by the data address
+    uint8_t state;          // EMU_ state of its i2c transaction
+    uint8_t holding;        // ACKed in a read, it drives SDA with the next byte until it is NACKed
+    uint8_t addrbytes;      // data address bytes still to come
+    uint32_t ptr;           // current data address
+    uint32_t pagebase;
+    uint8_t page[EEPROM_MAX_PAGE_SZ];       // bytes latched for the write cycle
+    uint8_t pagemask[EEPROM_MAX_PAGE_SZ];
+    uint8_t dirty;
+    double busyuntil;       // end of its write cycle
+};
+
+// one emulated CH341 and the EEPROMs on its i2c bus
+struct ch341emudev {
+    struct ch341emu *emu;
+    uint32_t index;
+    uint8_t claimed;
+    struct ch341emuchip chips[MAX_TARGETS];
+    uint32_t nchips;
+    struct ch341emuchip *selected;  // the EEPROM that acknowledged the last address
+    uint8_t devaddr;        // the next OUT byte is a device address, after a START
+    uint32_t speed;         // CH341_I2C_ speed index
+    double freeat;          // end of the i2c traffic queued so far
+    struct ch341emupacket *packets, *lastpacket;
+    struct ch341emupending *waiting;    // IN transfers submitted before their packet
+};
+
+// the emulator behind a context and the contexts of the adapters it opened
+struct ch341emu {
+    struct ch341emuconfig config;
+    char *dir;              // copy of config.dir, for the EEPROM and FIFO files
+    pthread_mutex_t lock;
+    pthread_cond_t wake;    // a transfer was submitted, completed or cancelled
+    double start;
+    struct ch341emudev devs[MAX_GANG_ADAPTERS];
+    struct ch341emupending *done;   // transfers to call back once they are ready
+    uint32_t refs;
+    uint32_t outxfers, inxfers;
+    uint64_t outbytes;
+};
+
+// one line of a --jobs manifest and how it went
+struct ch341manifestjob {
+    struct ch341job job;
+    char *line;             // the arguments of the job point into it
+    uint32_t lineno;
+    int32_t adapter;        // worker that ran it, -1 if it never ran
+    int32_t status;
+    double seconds;
+};
+
+// the jobs of a manifest, handed out in order to whichever adapter is idle
+struct ch341jobqueue {
+    struct ch341manifestjob *jobs;
+    uint32_t njobs;
+    uint32_t next;          // first job no adapter has taken yet
+    pthread_mutex_t lock;
+};
+
+// one adapter taking jobs from the queue until it is empty
+struct ch341jobsworker {
+    pthread_t thread;
+    struct ch341ctx *ctx;
+    uint32_t index;
+    uint8_t bus;
+    uint8_t address;
+    uint32_t speed;         // bus speed set for the last job, the next may need another
+    struct ch341jobqueue *queue;
+    uint8_t *readbuf;
+    uint32_t done;
+    double busy;
+};
+
+// one read block (up to 0x80 bytes) in flight: its BULK OUT command and the BULK IN packets it returns
+struct ch341readslot {
+    struct ch341readstate *state;
+    struct libusb_transfer *xferBulkOut;
+    struct libusb_transfer *xferBulkIn[EEPROM_READ_PKTS_PER_BLOCK];
+    uint8_t outbuf[EEPROM_READ_BULKOUT_BUF_SZ];
+    uint8_t bounce[EEPROM_READ_BLOCK_SZ];   // the block, when the read has no buffer
+    uint8_t *data;          // where the block lands
+    uint32_t offset;        // EEPROM address of the block
+    uint32_t length;
+    int32_t npkts;          // BULK IN packets the block returns
+    int32_t pending;        // transfers of this slot not yet completed
+    int32_t inpending;      // BULK IN packets of this slot not yet received
+};
+
+// progress of one ch341readEEPROM() call, shared by all of its slots
+struct ch341readstate {
+    struct ch341ctx *ctx;
+    struct EEPROM *eeprom_info;
+    uint8_t *buffer;        // indexed by EEPROM address, NULL to only hand the blocks to blockcb
+    struct ch341range *ranges;
+    uint32_t nranges;
+    uint32_t rangeidx;      // range of the next block to request
+    uint32_t nextaddr;      // address of the next block to request
+    uint32_t bytestoread;
+    uint32_t bytesdone;     // bytes received so far
+    uint32_t timeout;
+    int32_t inflight;       // submitted transfers not yet completed
+    int32_t error;
+    int stopping;           // early exit: no more blocks are requested, those in flight are received and dropped
+    int open;               // the last block requested left a sequential read open on the bus
+    int completed;          // set by the callbacks to wake up the event loop
+    ch341blockcb blockcb;
+    void *cbarg;
+    struct ch341progress progress;
+};
+
+// one write transfer in flight: a BULK OUT with one or more pages and,
+// when ACK polling, the poll that follows it
+struct ch341writeslot {
+    struct ch341writestate *state;
+    struct libusb_transfer *xferBulkOut;
+    struct libusb_transfer *xferPollOut;
+    struct libusb_transfer *xferPollIn;
+    struct libusb_transfer *xferVerifyIn[WRITE_VERIFY_PKTS];
+    uint8_t outbuf[CH341_MAX_BULK_OUT_SZ];
+    uint8_t pollbuf[6];
+    uint8_t verifybuf[CH341_MAX_BULK_OUT_SZ];
+    struct ch341range readback[MAX_WRITE_BATCH + 1];   // pages read back, in verifybuf order
+    uint32_t nreadback;
+    int32_t npkts;          // BULK IN packets of the readback
+    uint8_t status;         // ACK status returned by the last poll
+    uint8_t written;        // the transfer writes at least one page
+    struct ch341range page; // last page written by the transfer
+    struct ch341range polled;   // first page written by it, whose write cycle ends first
+    uint32_t bytes;         // new image bytes carried by the transfer
+    int32_t polls;
+    double deadline;        // stop polling after this
+    int32_t pending;        // transfers of this slot not yet completed
+};
+
+// progress of one ch341writePages() call, shared by all of its slots
+struct ch341writestate {
+    struct ch341ctx *ctx;
+    struct EEPROM *eeprom_info;
+    uint8_t *buffer;
+    uint32_t wrap;          // buffer repeats every wrap bytes, 0 if indexed by EEPROM address
+    struct ch341range *ranges;
+    uint32_t nranges;
+    uint32_t rangeidx;      // range of the next page to send
+    uint32_t nextaddr;      // address of the next page to send
+    uint32_t bytestowrite;
+    uint32_t byteswritten;  // bytes of completed transfers
+    uint32_t timeout;
+    struct EEPROM *targets; // several chips, pages interleaved across them (see ch341writeTarget())
+    uint32_t ntargets;      // 0 when writing the one eeprom_info device
+    uint32_t batch;         // pages per BULK OUT transfer
+    uint8_t ackpoll;        // poll after each page rather than have the CH341 wait
+    uint8_t verify;         // read back every page after its write cycle
+    struct ch341range retry[MAX_WRITE_BATCH * WRITE_QUEUE_DEPTH + 1];  // pages to write again
+    uint32_t nretry;
+    struct ch341range carry;// ACK polling: page written by the last transfer, read back with the next
+    uint8_t *tries;         // rewrites so far, per page
+    uint32_t rewrites;
+    int32_t inflight;       // submitted transfers not yet completed
+    int32_t error;
+    int completed;          // set by the callbacks to wake up the event loop
+    struct ch341progress progress;
+};
 
-int32_t ch341readEEPROM(struct libusb_device_handle *devHandle, uint8_t *buf, uint32_t bytes, struct EEPROM* eeprom_info);
-int32_t ch341writeEEPROM(struct libusb_device_handle *devHandle, uint8_t *buf, uint32_t bytes, struct EEPROM* eeprom_info);
-struct libusb_device_handle *ch341configure(uint16_t vid, uint16_t pid);
-int32_t ch341setstream(struct libusb_device_handle *devHandle, uint32_t speed);
-int32_t parseEEPsize(char* eepromname, struct EEPROM *eeprom);
+extern volatile sig_atomic_t ch341interrupted;
+
+size_t ch341ReadCmdMarshall(uint8_t *buffer, uint32_t addr, uint32_t len, uint8_t start, uint8_t stop, struct EEPROM *eeprom_info);
+uint32_t ch341readRegionSize(struct EEPROM *eeprom_info);
+int ch341rangeCompare(const void *a, const void *b);
+uint32_t ch341readCoalesce(struct ch341range *ranges, uint32_t nranges, uint32_t gap);
+void ch341readSubmitBlock(struct ch341readslot *slot);
+void ch341readSlotDone(struct ch341readslot *slot);
+void ch341cancelTransfer(struct ch341ctx *ctx, struct libusb_transfer *transfer);
+void ch341drainBulkIn(struct ch341ctx *ctx);
+int32_t ch341readClose(struct ch341ctx *ctx);
+size_t ch341WriteCmdMarshall(uint8_t *buffer, uint32_t addr, uint8_t *data, uint32_t len, struct EEPROM *eeprom_info);
+int32_t ch341writePages(struct ch341ctx *ctx, uint8_t *buffer, uint32_t wrap, struct ch341range *ranges, uint32_t nranges,
+                        struct EEPROM *eeprom_info, struct EEPROM *targets, uint32_t ntargets);
+struct EEPROM *ch341writeTarget(struct ch341writestate *state, uint32_t addr, uint32_t *devaddr);
+uint32_t ch341writePeekPage(struct ch341writestate *state, struct ch341range *page);
+void ch341writeTakePage(struct ch341writestate *state);
+size_t ch341writeFillSlot(struct ch341writeslot *slot);
+void ch341writeSubmitSlot(struct ch341writeslot *slot);
+void ch341writeSubmitPoll(struct ch341writeslot *slot);
+void ch341writeCheckSlot(struct ch341writeslot *slot);
+void ch341writeSlotDone(struct ch341writeslot *slot);
+int32_t cbFillScan(uint32_t offset, uint8_t *data, uint32_t len, void *arg);
+int32_t cbBlankCheck(uint32_t offset, uint8_t *data, uint32_t len, void *arg);
+int32_t cbVerify(uint32_t offset, uint8_t *data, uint32_t len, void *arg);
+uint32_t ch341diffPages(uint8_t *chip, uint8_t *image, uint32_t bytes, uint16_t page_size, struct ch341range *ranges);
+uint8_t ch341i2cAddress(struct EEPROM *eeprom_info, uint32_t addr);
+size_t ch341PollCmdMarshall(uint8_t *buffer, uint32_t addr, struct EEPROM *eeprom_info);
+int32_t ch341ackPoll(struct ch341ctx *ctx, struct EEPROM *eeprom_info, uint32_t addr);
+size_t ch341DelayCmdMarshall(uint8_t *buffer, uint32_t ms);
+int32_t parseFill(char *arg, uint8_t *pattern, uint32_t maxlen);
+int32_t parsePatch(char *arg, struct ch341range *range, uint8_t *data, uint32_t maxlen);
+int32_t parseRange(char *arg, struct ch341range *range, char **filename);
+int32_t parseTarget(char *arg, uint8_t *cs, char **filename);
+
+int32_t ch341calibrateSample(struct ch341ctx *ctx, struct EEPROM *eeprom_info, uint32_t addr, uint8_t *page);
+
+int32_t ch341hashParseType(char *name);
+char *ch341hashName(uint8_t type);
+void ch341hashCrcTable(void);
+void ch341hashInit(struct ch341hash *hash, uint8_t type);
+void ch341hashBlock(struct ch341hash *hash);
+void ch341hashUpdate(struct ch341hash *hash, uint8_t *data, uint32_t len);
+void ch341hashFinal(struct ch341hash *hash, char *hex);
+
+void ch341jobInit(struct ch341job *job);
+int32_t ch341parseJob(int argc, char **argv, struct ch341job *job);
+int32_t ch341setupTWR(struct ch341job *job, struct ch341ctx *ctx);
+int32_t ch341runJob(struct ch341job *job, struct ch341ctx *ctx, uint8_t *readbuf);
+char *ch341resultName(int32_t status);
+void *ch341gangWorker(void *arg);
+int32_t ch341gangRun(struct ch341job *job, struct ch341ctx *ctx, uint32_t speed);
+int32_t ch341jobsLoad(struct ch341job *defaults, struct ch341jobqueue *queue);
+void ch341jobsFree(struct ch341jobqueue *queue);
+void *ch341jobsWorker(void *arg);
+int32_t ch341jobsRun(struct ch341job *job, struct ch341ctx *ctx);
+int32_t ch341serveRequest(int conn, struct ch341ctx *ctx, uint8_t *readbuf, uint32_t *speed, struct ch341tuning *tuning);
+int32_t ch341serve(struct ch341job *served, uint8_t *readbuf);
+int32_t ch341clientRun(char *path, int argc, char **argv);
+
+double ch341progressNow(void);
+int32_t ch341progressParseMode(char *name);
+void ch341progressPrint(struct ch341progress *progress, uint32_t done, double now);
+void ch341progressStart(struct ch341progress *progress, struct ch341ctx *ctx, char *label, char *op, uint32_t total);
+void ch341progressUpdate(struct ch341progress *progress, uint32_t done);
+void ch341progressEnd(struct ch341progress *progress, uint32_t done);
+
+extern struct ch341transport ch341usbTransport, ch341emuTransport;
+int32_t ch341usbClaim(struct ch341ctx *ctx, struct libusb_device_handle *devHandle);
+int32_t ch341usbOpen(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct libusb_device_handle **handles, int32_t max);
+void ch341usbClose(struct ch341ctx *ctx);
+void ch341usbRelease(struct ch341ctx *ctx);
+void ch341usbLocation(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address);
+int ch341usbBulk(struct ch341ctx *ctx, uint8_t endpoint, uint8_t *data, int len, int *actual, uint32_t timeout);
+struct libusb_transfer *ch341usbAlloc(void);
+int ch341usbEvents(struct ch341ctx *ctx, struct timeval *tv, int *completed);
+
+double ch341emuNow(struct ch341emu *emu);
+void ch341emuWait(struct ch341emu *emu, double until);
+uint8_t ch341emuBlockBits(struct EEPROM *info);
+int32_t ch341emuChip(struct ch341emu *emu, struct ch341emuchip *chip, struct EEPROM *info, uint32_t adapter, uint32_t cs);
+void ch341emuStop(struct ch341emudev *dev, double t);
+int32_t ch341emuAddress(struct ch341emuchip *chip, uint8_t byte, double t);
+int32_t ch341emuOut(struct ch341emudev *dev, uint8_t byte, double t);
+uint8_t ch341emuIn(struct ch341emudev *dev);
+void ch341emuPacket(struct ch341emudev *dev, uint8_t *data, uint32_t len, double ready);
+void ch341emuFifoLoad(struct ch341emudev *dev);
+void ch341emuFifoSave(struct ch341emudev *dev);
+double ch341emuStream(struct ch341emudev *dev, uint8_t *buf, uint32_t len, double now);
+void ch341emuDone(struct ch341emu *emu, struct libusb_transfer *transfer, double ready);
+int32_t ch341emuOpen(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct libusb_device_handle **handles, int32_t max);
+void ch341emuClose(struct ch341ctx *ctx);
+void ch341emuRelease(struct ch341ctx *ctx);
+void ch341emuLocation(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address);
+int ch341emuBulk(struct ch341ctx *ctx, uint8_t endpoint, uint8_t *data, int len, int *actual, uint32_t timeout);
+struct libusb_transfer *ch341emuAlloc(void);
+void ch341emuFree(struct libusb_transfer *transfer);
+int ch341emuSubmit(struct libusb_transfer *transfer);
+int ch341emuCancel(struct libusb_transfer *transfer);
+int ch341emuEvents(struct ch341ctx *ctx, struct timeval *tv, int *completed);
 
 // callback functions for async USB transfers
 void cbBulkIn(struct libusb_transfer *transfer);
 void cbBulkOut(struct libusb_transfer *transfer);
+void cbWriteOut(struct libusb_transfer *transfer);
+void cbWritePollIn(struct libusb_transfer *transfer);
+void cbWriteVerifyIn(struct libusb_transfer *transfer);
@@ -0,0 +1,787 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+//
+//   CH341A and 24Cxx emulator: a transport that runs the i2c stream commands
+//   of each BULK OUT transfer against EEPROMs kept in files, in real time.
+//   every byte on the bus takes its 9 bit times at the set speed, each
+//   transfer half the USB round trip each way, and a written page keeps the
+//   EEPROM busy, NACKing its address, for the write cycle time
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+// the transport of the emulated CH341s
+struct ch341transport ch341emuTransport = {
+    ch341emuOpen, ch341emuClose, ch341emuRelease, ch341emuLocation, ch341emuBulk,
+    ch341emuAlloc, ch341emuFree, ch341emuSubmit, ch341emuCancel, ch341emuEvents
+};
+
+// an emulated adapter stands in for the libusb handle of a context and its
+// transfers; none of them is ever passed to libusb
+#define EMUDEV(handle)      ((struct ch341emudev *) (handle))
+#define EMUHANDLE(dev)      ((struct libusb_device_handle *) (dev))
+
+static const uint32_t emukhz[] = {20, 100, 400, 750};  // CH341_I2C_ speeds
+
+// --------------------------------------------------------------------------
+// ch341emuParse()
+//      passed "dir[,chip=24c64][,adapters=n][,chips=n][,latency=us][,twr=us][,fifo=keep]",
+//      fills in config, pointing into spec. returns -1 if malformed
+int32_t ch341emuParse(char *spec, struct ch341emuconfig *config) {
+    char *opt, *val, *save;
+
+    memset(config, 0, sizeof(struct ch341emuconfig));
+    config->adapters  = 1;
+    config->chips     = 1;
+    config->latencyus = EMU_LATENCY_US;
+    config->twrus     = EMU_TWR_US;
+
+    if(!(config->dir = strtok_r(spec, ",", &save)) || strchr(config->dir, '=')) {
+        fprintf(stderr, "Emulator options should start with the directory of the EEPROM files\n");
+        return -1;
+    }
+    while((opt = strtok_r(NULL, ",", &save))) {
+        if(!(val = strchr(opt, '='))) {
+            fprintf(stderr, "Emulator option [%s] has no value\n", opt);
+            return -1;
+        }
+        *val++ = 0;
+        if(!strcmp(opt, "chip"))
+            config->chip = val;
+        else if(!strcmp(opt, "adapters"))
+            config->adapters = (uint32_t) strtoul(val, NULL, 0);
+        else if(!strcmp(opt, "chips"))
+            config->chips = (uint32_t) strtoul(val, NULL, 0);
+        else if(!strcmp(opt, "latency"))
+            config->latencyus = (uint32_t) strtoul(val, NULL, 0);
+        else if(!strcmp(opt, "twr"))
+            config->twrus = (uint32_t) strtoul(val, NULL, 0);
+        else if(!strcmp(opt, "fifo") && (!strcmp(val, "keep") || !strcmp(val, "drop")))
+            config->keepfifo = !strcmp(val, "keep");
+        else {
+            fprintf(stderr, "Unknown emulator option [%s]\n", opt);
+            return -1;
+        }
+    }
+
+    if(config->adapters < 1 || config->adapters > MAX_GANG_ADAPTERS) {
+        fprintf(stderr, "Emulated adapters should be between 1 and %d\n", MAX_GANG_ADAPTERS);
+        return -1;
+    }
+    if(config->chips < 1 || config->chips > MAX_TARGETS) {
+        fprintf(stderr, "Emulated EEPROMs per adapter should be between 1 and %d\n", MAX_TARGETS);
+        return -1;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuBlockBits()
+//      device address bits a 24Cxx takes for the top of its data address,
+//      leaving the rest to its chip select pins
+uint8_t ch341emuBlockBits(struct EEPROM *info) {
+    uint8_t bits = 0;
+
+    while(((info->addr_size == 1 ? 0x100u : 0x10000u) << bits) < info->size)
+        bits++;
+    return bits;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuChip()
+//      set up EEPROM number cs of an adapter, mapping the file that keeps its
+//      contents. a missing file, or one of another size, starts out erased
+//      returns -1 if the file cant be used
+int32_t ch341emuChip(struct ch341emu *emu, struct ch341emuchip *chip, struct EEPROM *info, uint32_t adapter, uint32_t cs) {
+    char path[PATH_MAX];
+    struct stat st;
+    uint8_t erased = FALSE;
+    int fd;
+
+    chip->info      = *info;
+    chip->blockbits = ch341emuBlockBits(info);
+    chip->cs        = cs << chip->blockbits;
+    snprintf(path, sizeof(path), "%s/adapter%d-cs%d.bin", emu->dir, adapter, chip->cs);
+
+    if((fd = open(path, O_RDWR | O_CREAT, 0644)) < 0 || fstat(fd, &st) < 0) {
+        fprintf(stderr, "Couldnt open emulated EEPROM file [%s]: '%s'\n", path, strerror(errno));
+        if(fd >= 0)
+            close(fd);
+        return -1;
+    }
+    if(st.st_size != info->size) {
+        if(ftruncate(fd, 0) < 0 || ftruncate(fd, info->size) < 0) {
+            fprintf(stderr, "Couldnt size emulated EEPROM file [%s]: '%s'\n", path, strerror(errno));
+            close(fd);
+            return -1;
+        }
+        erased = TRUE;
+    }
+    chip->mem = mmap(NULL, info->size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if(chip->mem == MAP_FAILED) {
+        fprintf(stderr, "Couldnt map emulated EEPROM file [%s]: '%s'\n", path, strerror(errno));
+        chip->mem = NULL;
+        return -1;
+    }
+    if(erased)
+        memset(chip->mem, 0xff, info->size);
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341ctxEmulate()
+//      put a context that has no adapter yet on a new emulator, whose adapters
+//      ch341configure() and ch341configureAll() then find instead of real ones
+//      returns -1 if the configuration cant be emulated
+int32_t ch341ctxEmulate(struct ch341ctx *ctx, struct ch341emuconfig *config) {
+    struct ch341emu *emu;
+    struct ch341emudev *dev;
+    struct EEPROM info;
+    uint32_t i, k;
+
+    if(ctx->devHandle || ctx->emu) {
+        fprintf(stderr, "Emulate before configuring the context\n");
+        return -1;
+    }
+    if(!config->chip || parseEEPsize(config->chip, &info) < 0) {
+        fprintf(stderr, "Unknown EEPROM [%s] to emulate\n", config->chip ? config->chip : "");
+        return -1;
+    }
+    if((config->chips << ch341emuBlockBits(&info)) > MAX_TARGETS) {
+        fprintf(stderr, "Only [%d] [%s] EEPROMs fit on one i2c bus\n", MAX_TARGETS >> ch341emuBlockBits(&info), info.name);
+        return -1;
+    }
+    if(mkdir(config->dir, 0755) < 0 && errno != EEXIST) {
+        fprintf(stderr, "Couldnt create emulator directory [%s]: '%s'\n", config->dir, strerror(errno));
+        return -1;
+    }
+    if(!(emu = (struct ch341emu *) calloc(1, sizeof(struct ch341emu)))) {
+        fprintf(stderr, "Couldnt allocate the emulator\n");
+        return -1;
+    }
+    emu->config = *config;
+    emu->start  = ch341progressNow();
+    emu->refs   = 1;
+    pthread_mutex_init(&emu->lock, NULL);
+    pthread_cond_init(&emu->wake, NULL);
+    ctx->emu       = emu;                           // from here on ch341ctxFree() undoes it all
+    ctx->transport = &ch341emuTransport;
+    if(!(emu->dir = strdup(config->dir))) {
+        fprintf(stderr, "Couldnt allocate the emulator\n");
+        return -1;
+    }
+
+    for(i=0; i < config->adapters; i++) {
+        dev = &emu->devs[i];
+        dev->emu    = emu;
+        dev->index  = i;
+        dev->speed  = CH341_I2C_STANDARD_SPEED;
+        dev->nchips = config->chips;
+        for(k=0; k < config->chips; k++)
+            if(ch341emuChip(emu, &dev->chips[k], &info, i, k) < 0)
+                return -1;
+        if(config->keepfifo)
+            ch341emuFifoLoad(dev);
+    }
+    fprintf(ctx->verbout, "Emulating [%d] CH341 adapters with [%d] [%s] EEPROMs each in [%s]\n", config->adapters, config->chips, info.name, config->dir);
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuNow()
+//      microseconds since the emulator started
+double ch341emuNow(struct ch341emu *emu) {
+    return (ch341progressNow() - emu->start) * 1e6;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuWait()
+//      with the lock held, sleep until the emulator time until, or until a
+//      transfer is submitted, completed or cancelled, whichever comes first
+void ch341emuWait(struct ch341emu *emu, double until) {
+    struct timespec ts;
+    double us = until - ch341emuNow(emu);
+
+    if(us <= 0)
+        return;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    ts.tv_sec  += (time_t) (us / 1e6);
+    ts.tv_nsec += (long) ((us - (time_t) (us / 1e6) * 1e6) * 1e3);
+    if(ts.tv_nsec >= 1000000000) {
+        ts.tv_sec++;
+        ts.tv_nsec -= 1000000000;
+    }
+    pthread_cond_timedwait(&emu->wake, &emu->lock, &ts);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuStop()
+//      a STOP on the bus: a page write that was addressed and given data
+//      starts its write cycle. lost, like a START, while an EEPROM holds SDA
+void ch341emuStop(struct ch341emudev *dev, double t) {
+    struct ch341emuchip *chip = dev->selected;
+    uint32_t i;
+
+    if(!chip || chip->holding)
+        return;
+    if(chip->state == EMU_WRITE && chip->dirty) {
+        for(i=0; i < chip->info.page_size; i++)
+            if(chip->pagemask[i])
+                chip->mem[chip->pagebase + i] = chip->page[i];
+        chip->busyuntil = t + dev->emu->config.twrus;
+    }
+    chip->state = EMU_IDLE;
+    chip->dirty = FALSE;
+    dev->selected = NULL;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuAddress()
+//      the device address byte after a START, as one EEPROM sees it
+//      returns 1 if it acknowledges
+int32_t ch341emuAddress(struct ch341emuchip *chip, uint8_t byte, double t) {
+    uint8_t bits = (byte >> 1) & 7, block = (1 << chip->blockbits) - 1;
+
+    if((byte >> 4) != 0xa || (bits & ~block) != chip->cs || t < chip->busyuntil)
+        return 0;                                   // not this one, or busy with its write cycle
+
+    chip->holding = FALSE;
+    if(byte & 1)                                    // reads go on from the current address
+        chip->state = EMU_READ;
+    else {
+        chip->state     = EMU_ADDRESS;
+        chip->addrbytes = chip->info.addr_size;
+        chip->ptr       = (uint32_t) (bits & block) << (8 * chip->info.addr_size);
+    }
+    return 1;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuOut()
+//      one byte the CH341 clocks out. returns 1 if it was acknowledged
+int32_t ch341emuOut(struct ch341emudev *dev, uint8_t byte, double t) {
+    struct ch341emuchip *chip = dev->selected;
+    uint32_t i, off;
+
+    if(dev->devaddr) {
+        dev->devaddr = FALSE;
+        for(i=0; i < dev->nchips; i++)
+            if(ch341emuAddress(&dev->chips[i], byte, t))
+                dev->selected = &dev->chips[i];
+        return dev->selected != NULL;
+    }
+    if(!chip)
+        return 0;
+
+    if(chip->holding) {                             // it clocks out its next byte instead and,
+        chip->ptr = (chip->ptr + 1) & (chip->info.size - 1);
+        chip->holding = FALSE;                      // as no one ACKs it, lets go of SDA
+        chip->state   = EMU_IDLE;
+        return 0;
+    }
+    if(chip->state == EMU_ADDRESS) {
+        chip->ptr |= (uint32_t) byte << (8 * --chip->addrbytes);
+        if(!chip->addrbytes) {                      // the data address is complete
+            chip->ptr &= chip->info.size - 1;
+            chip->pagebase = chip->ptr & ~(uint32_t) (chip->info.page_size - 1);
+            memset(chip->pagemask, 0, sizeof(chip->pagemask));
+            chip->dirty = FALSE;
+            chip->state = EMU_WRITE;
+        }
+        return 1;
+    }
+    if(chip->state == EMU_WRITE) {                  // latched, wrapping around within the page
+        off = chip->ptr - chip->pagebase;
+        chip->page[off]     = byte;
+        chip->pagemask[off] = TRUE;
+        chip->dirty         = TRUE;
+        chip->ptr = chip->pagebase + ((off + 1) & (chip->info.page_size - 1));
+        return 1;
+    }
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuIn()
+//      one byte the CH341 clocks in, 0xff if no EEPROM is sending
+uint8_t ch341emuIn(struct ch341emudev *dev) {
+    struct ch341emuchip *chip = dev->selected;
+    uint8_t byte;
+
+    if(!chip || chip->state != EMU_READ)
+        return 0xff;
+    byte = chip->mem[chip->ptr];
+    chip->ptr = (chip->ptr + 1) & (chip->info.size - 1);
+    return byte;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuPacket()
+//      a BULK IN packet the CH341 has for the host at ready, queued in its
+//      FIFO. an IN transfer only takes it once it is there, see
+//      ch341emuEvents(); one cancelled before then leaves it for the next read
+void ch341emuPacket(struct ch341emudev *dev, uint8_t *data, uint32_t len, double ready) {
+    struct ch341emupacket *packet;
+
+    if(!(packet = (struct ch341emupacket *) calloc(1, sizeof(struct ch341emupacket)))) {
+        fprintf(stderr, "Emulator: couldnt allocate a BULK IN packet, dropped\n");
+        return;
+    }
+    memcpy(packet->data, data, len);
+    packet->len   = len;
+    packet->ready = ready;
+    if(dev->lastpacket)
+        dev->lastpacket->next = packet;
+    else
+        dev->packets = packet;
+    dev->lastpacket = packet;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuFifoLoad()
+//      with fifo=keep, queue the BULK IN data an earlier run left unread
+void ch341emuFifoLoad(struct ch341emudev *dev) {
+    char path[PATH_MAX];
+    uint8_t data[mCH341_PACKET_LENGTH];
+    FILE *fp;
+    int len;
+
+    snprintf(path, sizeof(path), "%s/adapter%d-fifo.bin", dev->emu->dir, dev->index);
+    if(!(fp = fopen(path, "rb")))
+        return;
+    while((len = fgetc(fp)) > 0 && len <= mCH341_PACKET_LENGTH && fread(data, 1, len, fp) == (size_t) len)
+        ch341emuPacket(dev, data, len, 0);
+    fclose(fp);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuFifoSave()
+//      with fifo=keep, save the BULK IN data still unread for the next run,
+//      a length byte and the data of each packet
+void ch341emuFifoSave(struct ch341emudev *dev) {
+    char path[PATH_MAX];
+    struct ch341emupacket *packet;
+    FILE *fp;
+
+    snprintf(path, sizeof(path), "%s/adapter%d-fifo.bin", dev->emu->dir, dev->index);
+    if(!dev->packets) {
+        unlink(path);
+        return;
+    }
+    if(!(fp = fopen(path, "wb"))) {
+        fprintf(stderr, "Couldnt save the unread BULK IN data to [%s]: '%s'\n", path, strerror(errno));
+        return;
+    }
+    for(packet = dev->packets; packet; packet = packet->next) {
+        fputc(packet->len, fp);
+        fwrite(packet->data, 1, packet->len, fp);
+    }
+    fclose(fp);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuStream()
+//      run the i2c stream commands of a BULK OUT transfer sent at now, one
+//      32 byte packet at a time, each starting with AA and ending at 00 or
+//      its last byte. packets that read return one BULK IN packet each
+//      returns the time the transfer completes
+double ch341emuStream(struct ch341emudev *dev, uint8_t *buf, uint32_t len, double now) {
+    struct ch341emuconfig *config = &dev->emu->config;
+    double start = MAX(now + config->latencyus / 2.0, dev->freeat), t = start, byteus;
+    uint8_t in[mCH341_PACKET_LENGTH * 2], *q, c;
+    uint32_t p, n, i, j, k, nin;
+
+    for(p = 0; p < len; p += mCH341_PACKET_LENGTH) {
+        n = MIN(len - p, mCH341_PACKET_LENGTH);
+        q = buf + p;
+        nin = 0;
+        if(q[0] != mCH341A_CMD_I2C_STREAM) {
+            fprintf(stderr, "Emulator: packet at [%d] of a BULK OUT transfer isnt an i2c stream [%02x]\n", p, q[0]);
+            continue;
+        }
+        for(i = 1; i < n; ) {
+            byteus = 9000.0 / emukhz[dev->speed];   // 8 bits and the ACK
+            c = q[i++];
+            if(c == mCH341A_CMD_I2C_STM_END)
+                break;
+            else if(c == mCH341A_CMD_I2C_STM_STA) { // a repeated START abandons a page write
+                if(dev->selected && dev->selected->holding)
+                    dev->devaddr = FALSE;           // but is lost while an EEPROM holds SDA
+                else {
+                    if(dev->selected)
+                        dev->selected->state = EMU_IDLE;
+                    dev->selected = NULL;
+                    dev->devaddr  = TRUE;
+                }
+                t += byteus;
+            } else if(c == mCH341A_CMD_I2C_STM_STO) {
+                ch341emuStop(dev, t);
+                t += byteus;
+            } else if((c & 0xf0) == mCH341A_CMD_I2C_STM_SET)
+                dev->speed = c & 3;
+            else if((c & 0xf0) == mCH341A_CMD_I2C_STM_MS)
+                t += 1000.0 * (c & mCH341A_CMD_I2C_STM_DLY);
+            else if((c & 0xf0) == mCH341A_CMD_I2C_STM_US)
+                t += c & mCH341A_CMD_I2C_STM_DLY;
+            else if((c & 0xc0) == mCH341A_CMD_I2C_STM_OUT) {
+                if(!(k = c & 0x3f)) {               // one byte, its ACK status goes back
+                    if(i >= n)
+                        break;
+                    in[nin++] = ch341emuOut(dev, q[i++], t) ? 0x00 : 0x80;
+                    t += byteus;
+                    continue;
+                }
+                if(i + k > n) {
+                    fprintf(stderr, "Emulator: OUT of [%d] bytes runs past the end of its packet\n", k);
+                    break;
+                }
+                for(j=0; j < k; j++, t += byteus)
+                    ch341emuOut(dev, q[i++], t);
+            } else if((c & 0xc0) == mCH341A_CMD_I2C_STM_IN) {
+                k = (c & 0x3f) ? (c & 0x3f) : 1;
+                for(j=0; j < k && nin < sizeof(in); j++, t += byteus)
+                    in[nin++] = ch341emuIn(dev);
+                if(dev->selected && dev->selected->state == EMU_READ)
+                    if(!(dev->selected->holding = (c & 0x3f) != 0))
+                        dev->selected->state = EMU_IDLE;    // NACKed, it lets go of SDA
+            } else
+                fprintf(stderr, "Emulator: unknown i2c stream command [%02x]\n", c);
+        }
+        if(nin > mCH341_PACKET_LENGTH) {
+            fprintf(stderr, "Emulator: [%d] bytes read in one packet, the CH341 returns at most %d\n", nin, mCH341_PACKET_LENGTH);
+            nin = mCH341_PACKET_LENGTH;
+        }
+        if(nin)
+            ch341emuPacket(dev, in, nin, t + config->latencyus / 2.0);
+    }
+    dev->freeat = t;
+    return MAX(start + config->latencyus / 2.0, t);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuDone()
+//      a transfer to be called back once the time ready has come
+void ch341emuDone(struct ch341emu *emu, struct libusb_transfer *transfer, double ready) {
+    struct ch341emupending *done;
+
+    if(!(done = (struct ch341emupending *) calloc(1, sizeof(struct ch341emupending)))) {
+        fprintf(stderr, "Emulator: couldnt queue a completed transfer, lost\n");
+        return;
+    }
+    done->transfer = transfer;
+    done->ready    = ready;
+    done->next     = emu->done;
+    emu->done      = done;
+    pthread_cond_broadcast(&emu->wake);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuOpen()
+//      claim the emulated adapters nobody has claimed yet, up to max of them
+//      returns the number of adapters in handles
+int32_t ch341emuOpen(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct libusb_device_handle **handles, int32_t max) {
+    struct ch341emu *emu = ctx->emu;
+    struct ch341emudev *dev;
+    int32_t n = 0;
+    uint32_t i;
+
+    if(vid != USB_LOCK_VENDOR || pid != USB_LOCK_PRODUCT)
+        return 0;
+    pthread_mutex_lock(&emu->lock);
+    for(i=0; i < emu->config.adapters && n < max; i++) {
+        dev = &emu->devs[i];
+        if(dev->claimed)
+            continue;
+        dev->claimed = TRUE;
+        handles[n++] = EMUHANDLE(dev);
+        fprintf(ctx->verbout, "Found [%04x:%04x] as emulated device [%d]\n", vid, pid, i);
+    }
+    pthread_mutex_unlock(&emu->lock);
+    return n;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuClose()
+//      give the adapter of ctx back, dropping what it still had queued unless
+//      fifo=keep saves it for the next run
+void ch341emuClose(struct ch341ctx *ctx) {
+    struct ch341emudev *dev = EMUDEV(ctx->devHandle);
+    struct ch341emupacket *packet;
+    int unread = 0;
+
+    pthread_mutex_lock(&dev->emu->lock);
+    if(dev->emu->config.keepfifo)
+        ch341emuFifoSave(dev);
+    while((packet = dev->packets)) {
+        dev->packets = packet->next;
+        free(packet);
+        unread++;
+    }
+    dev->lastpacket = NULL;
+    dev->claimed    = FALSE;
+    pthread_mutex_unlock(&dev->emu->lock);
+    fprintf(ctx->verbout, "Closed emulated device [%d], [%d] BULK IN packets left unread\n", dev->index, unread);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuRelease()
+//      drop the reference of ctx to the emulator, the last one frees it and
+//      reports the traffic
+void ch341emuRelease(struct ch341ctx *ctx) {
+    struct ch341emu *emu = ctx->emu;
+    struct ch341emupending *done;
+    uint32_t i, k, refs;
+
+    if(!emu)
+        return;
+    ctx->emu = NULL;
+    pthread_mutex_lock(&emu->lock);
+    refs = --emu->refs;
+    pthread_mutex_unlock(&emu->lock);
+    if(refs)
+        return;
+
+    fprintf(ctx->verbout, "Emulator: [%d] BULK OUT transfers of [%llu] bytes, [%d] BULK IN transfers in [%.2fs]\n",
+        emu->outxfers, (unsigned long long) emu->outbytes, emu->inxfers, ch341emuNow(emu) / 1e6);
+    for(i=0; i < emu->config.adapters; i++)
+        for(k=0; k < emu->devs[i].nchips; k++)
+            if(emu->devs[i].chips[k].mem)
+                munmap(emu->devs[i].chips[k].mem, emu->devs[i].chips[k].info.size);
+    while((done = emu->done)) {
+        emu->done = done->next;
+        free(done);
+    }
+    pthread_cond_destroy(&emu->wake);
+    pthread_mutex_destroy(&emu->lock);
+    free(emu->dir);
+    free(emu);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuLocation()
+//      emulated adapters are on bus 0, numbered from 1
+void ch341emuLocation(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address) {
+    *bus     = 0;
+    *address = EMUDEV(ctx->devHandle)->index + 1;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuBulk()
+//      synchronous bulk transfer, returning when it would have completed
+int ch341emuBulk(struct ch341ctx *ctx, uint8_t endpoint, uint8_t *data, int len, int *actual, uint32_t timeout) {
+    struct ch341emudev *dev = EMUDEV(ctx->devHandle);
+    struct ch341emu *emu = dev->emu;
+    struct ch341emupacket *packet;
+    double now, ready;
+
+    pthread_mutex_lock(&emu->lock);
+    now = ch341emuNow(emu);
+    if(!(endpoint & LIBUSB_ENDPOINT_IN)) {
+        emu->outxfers++;
+        emu->outbytes += len;
+        ready = ch341emuStream(dev, data, len, now);
+        *actual = len;
+    } else {
+        emu->inxfers++;
+        if(!(packet = dev->packets)) {              // nothing was asked for: the CH341 stays silent
+            ready = now + timeout * 1000.0;
+            while(ch341emuNow(emu) < ready)
+                ch341emuWait(emu, ready);
+            pthread_mutex_unlock(&emu->lock);
+            *actual = 0;
+            return LIBUSB_ERROR_TIMEOUT;
+        }
+        if(!(dev->packets = packet->next))
+            dev->lastpacket = NULL;
+        *actual = MIN((int) packet->len, len);
+        memcpy(data, packet->data, *actual);
+        ready = MAX(packet->ready, now + emu->config.latencyus / 2.0);
+        free(packet);
+    }
+    while(ch341emuNow(emu) < ready)
+        ch341emuWait(emu, ready);
+    pthread_mutex_unlock(&emu->lock);
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuAlloc()
+//      a transfer for the emulator, filled in with libusb_fill_bulk_transfer()
+struct libusb_transfer *ch341emuAlloc(void) {
+    return (struct libusb_transfer *) calloc(1, sizeof(struct libusb_transfer));
+}
+
+// --------------------------------------------------------------------------
+// ch341emuFree()
+void ch341emuFree(struct libusb_transfer *transfer) {
+    free(transfer);
+}
+
+// --------------------------------------------------------------------------
+// ch341emuSubmit()
+//      an OUT runs at once and completes when the CH341 is done with it, an IN
+//      waits until its timeout for the next packet of the FIFO
+int ch341emuSubmit(struct libusb_transfer *transfer) {
+    struct ch341emudev *dev = EMUDEV(transfer->dev_handle);
+    struct ch341emu *emu = dev->emu;
+    struct ch341emupending *waiting, **tail;
+    double now;
+
+    pthread_mutex_lock(&emu->lock);
+    now = ch341emuNow(emu);
+    if(!(transfer->endpoint & LIBUSB_ENDPOINT_IN)) {
+        emu->outxfers++;
+        emu->outbytes += transfer->length;
+        transfer->actual_length = transfer->length;
+        transfer->status = LIBUSB_TRANSFER_COMPLETED;
+        ch341emuDone(emu, transfer, ch341emuStream(dev, transfer->buffer, transfer->length, now));
+    } else {
+        emu->inxfers++;
+        if(!(waiting = (struct ch341emupending *) calloc(1, sizeof(struct ch341emupending)))) {
+            pthread_mutex_unlock(&emu->lock);
+            return LIBUSB_ERROR_NO_MEM;
+        }
+        waiting->transfer = transfer;
+        waiting->ready    = now + (transfer->timeout ? transfer->timeout * 1000.0 : 1e12);
+        for(tail = &dev->waiting; *tail; tail = &(*tail)->next)
+            ;
+        *tail = waiting;
+        pthread_cond_broadcast(&emu->wake);
+    }
+    pthread_mutex_unlock(&emu->lock);
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuCancel()
+//      only an IN still waiting for its packet can be cancelled, the others
+//      are as good as done. the packet it was waiting for stays in the FIFO
+int ch341emuCancel(struct libusb_transfer *transfer) {
+    struct ch341emudev *dev = EMUDEV(transfer->dev_handle);
+    struct ch341emupending **pp, *waiting;
+
+    pthread_mutex_lock(&dev->emu->lock);
+    for(pp = &dev->waiting; *pp; pp = &(*pp)->next)
+        if((*pp)->transfer == transfer) {
+            waiting = *pp;
+            *pp = waiting->next;
+            free(waiting);
+            transfer->status = LIBUSB_TRANSFER_CANCELLED;
+            transfer->actual_length = 0;
+            ch341emuDone(dev->emu, transfer, ch341emuNow(dev->emu));
+            pthread_mutex_unlock(&dev->emu->lock);
+            return 0;
+        }
+    pthread_mutex_unlock(&dev->emu->lock);
+    return LIBUSB_ERROR_NOT_FOUND;
+}
+
+// --------------------------------------------------------------------------
+// ch341emuEvents()
+//      wait up to tv for transfers of the adapter of ctx to complete, time out
+//      its INs that waited too long, and call them back in the order they
+//      completed. unlike libusb, which calls back whichever thread's transfers
+//      are done, each thread only ever sees its own
+int ch341emuEvents(struct ch341ctx *ctx, struct timeval *tv, int *completed) {
+    struct ch341emudev *dev = EMUDEV(ctx->devHandle);
+    struct ch341emu *emu = ctx->emu;
+    struct ch341emupending *ready = NULL, **pp, **ins, *p;
+    struct ch341emupacket *packet;
+    double now, next, deadline;
+
+    pthread_mutex_lock(&emu->lock);
+    deadline = ch341emuNow(emu) + (tv ? tv->tv_sec * 1e6 + tv->tv_usec : 60e6);
+
+    while(!(completed && *completed)) {
+        now  = ch341emuNow(emu);
+        next = deadline;
+        while((p = dev->waiting) && (packet = dev->packets) && packet->ready <= now) {
+            dev->waiting = p->next;                 // the oldest IN takes the packet that reached the host
+            if(!(dev->packets = packet->next))
+                dev->lastpacket = NULL;
+            p->transfer->actual_length = MIN((int) packet->len, p->transfer->length);
+            memcpy(p->transfer->buffer, packet->data, p->transfer->actual_length);
+            p->transfer->status = LIBUSB_TRANSFER_COMPLETED;
+            p->ready  = packet->ready;
+            p->next   = emu->done;
+            emu->done = p;
+            free(packet);
+        }
+        if(dev->waiting && dev->packets)
+            next = MIN(next, dev->packets->ready);
+        for(pp = &dev->waiting; *pp; ) {
+            p = *pp;
+            if(p->ready > now) {
+                next = MIN(next, p->ready);
+                pp = &p->next;
+                continue;
+            }
+            *pp = p->next;                          // no packet came in time
+            p->transfer->status = LIBUSB_TRANSFER_TIMED_OUT;
+            p->transfer->actual_length = 0;
+            p->next = emu->done;
+            emu->done = p;
+        }
+
+        for(pp = &emu->done; *pp; ) {               // sorted into ready, oldest first
+            p = *pp;
+            if(EMUDEV(p->transfer->dev_handle) != dev) {
+                pp = &p->next;
+                continue;
+            }
+            if(p->ready > now) {
+                next = MIN(next, p->ready);
+                pp = &p->next;
+                continue;
+            }
+            *pp = p->next;
+            for(ins = &ready; *ins && (*ins)->ready <= p->ready; ins = &(*ins)->next)
+                ;
+            p->next = *ins;
+            *ins = p;
+        }
+        if(ready || now >= deadline)
+            break;
+        ch341emuWait(emu, next);
+    }
+    pthread_mutex_unlock(&emu->lock);
+
+    while((p = ready)) {
+        ready = p->next;
+        p->transfer->callback(p->transfer);
+        free(p);
+    }
+    return 0;
+}
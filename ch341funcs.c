@@ -25,119 +25,159 @@
 #include <stdint.h>
 #include <string.h>
 #include <assert.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
 #include "ch341eeprom.h"
 
-extern FILE *debugout, *verbout;
-uint32_t getnextpkt;                            // set by the callback function
-uint32_t syncackpkt;                            // synch / ack flag used by BULK OUT cb function
-uint32_t byteoffset;
-
 // --------------------------------------------------------------------------
-// ch341configure()
-//      lock USB device for exclusive use
-//      claim default interface
-//      set default configuration
-//      retrieve device descriptor
-//      identify device revision
-// returns *usb device handle
-
-struct libusb_device_handle *ch341configure(uint16_t vid, uint16_t pid) {
-
-    struct libusb_device *dev;
-    struct libusb_device_handle *devHandle;
-    int32_t ret=0;                    // set to < 0 to indicate USB errors
-    uint32_t i = 0;
-    int32_t currentConfig = 0;
-
-    uint8_t ch341DescriptorBuffer[0x12];
-
-    ret = libusb_init(NULL);
-    if(ret < 0) {
-        fprintf(stderr, "Couldnt initialise libusb\n");
+// ch341ctxNew()
+//      a context for one adapter with the default tuning, messages on stdout
+//      and no verbose or debug output. devHandle is a CH341 already opened and
+//      claimed with libusb, or NULL to open one with ch341configure()
+//      returns NULL if out of memory
+struct ch341ctx *ch341ctxNew(struct libusb_device_handle *devHandle) {
+    struct ch341ctx *ctx;
+
+    if(!(ctx = (struct ch341ctx *) calloc(1, sizeof(struct ch341ctx))))
         return NULL;
-    }
-
-
-
-    #if LIBUSBX_API_VERSION < 0x01000106
-        libusb_set_debug(NULL, 3);                  // maximum debug logging level
-    #else
-        libusb_set_option(NULL, LIBUSB_OPTION_LOG_LEVEL, 3);
-    #endif
-
-    fprintf(verbout, "Searching USB buses for WCH CH341a i2c EEPROM programmer [%04x:%04x]\n",
-            USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
-
-    if(!(devHandle = libusb_open_device_with_vid_pid(NULL, USB_LOCK_VENDOR, USB_LOCK_PRODUCT))) {
-        fprintf(stderr, "Couldn't open device [%04x:%04x]\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+    if(!(ctx->devnull = fopen("/dev/null", "w"))) {
+        free(ctx);
         return NULL;
     }
+    ctx->devHandle = devHandle;
+    ctx->transport = &ch341usbTransport;
+    ch341tuningDefaults(&ctx->tuning);
+    ch341ctxSetOutput(ctx, stdout, NULL, NULL);
+    ctx->cancel = &ctx->cancelled;
+    return ctx;
+}
 
-    if(!(dev = libusb_get_device(devHandle))) {
-        fprintf(stderr, "Couldnt get bus number and address of device\n");
-        return NULL;
-    }
+// --------------------------------------------------------------------------
+// ch341ctxFree()
+//      release and close the adapter of the context, then free it
+void ch341ctxFree(struct ch341ctx *ctx) {
+    if(!ctx)
+        return;
+    if(ctx->devHandle)
+        ctx->transport->close(ctx);
+    ctx->transport->release(ctx);
+    fclose(ctx->devnull);
+    free(ctx);
+}
 
-    fprintf(verbout, "Found [%04x:%04x] as device [%d] on USB bus [%d]\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT,
-        libusb_get_device_address(dev), libusb_get_bus_number(dev));
+// --------------------------------------------------------------------------
+// ch341ctxHandle()
+//      the USB handle of the adapter, NULL until configured
+struct libusb_device_handle *ch341ctxHandle(struct ch341ctx *ctx) {
+    return ctx->devHandle;
+}
 
-    fprintf(verbout, "Opened device [%04x:%04x]\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+// --------------------------------------------------------------------------
+// ch341ctxLocation()
+//      bus number and device address of the adapter, for telling them apart
+void ch341ctxLocation(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address) {
+    ctx->transport->location(ctx, bus, address);
+}
 
+// --------------------------------------------------------------------------
+// ch341ctxTuning()
+//      the tuning the next operations of the context use, to read or change
+struct ch341tuning *ch341ctxTuning(struct ch341ctx *ctx) {
+    return &ctx->tuning;
+}
 
-    if(libusb_kernel_driver_active(devHandle, DEFAULT_INTERFACE)) {
-        ret = libusb_detach_kernel_driver(devHandle, DEFAULT_INTERFACE);
-        if(ret) {
-            fprintf(stderr, "Failed to detach kernel driver: '%s'\n", strerror(-ret));
-            return NULL;
-        } else
-            fprintf(verbout, "Detached kernel driver\n");
-    }
+// --------------------------------------------------------------------------
+// ch341ctxSetOutput()
+//      where messages and progress, verbose and debug output go
+//      NULL discards verbose or debug output
+void ch341ctxSetOutput(struct ch341ctx *ctx, FILE *msgout, FILE *verbout, FILE *debugout) {
+    ctx->msgout   = msgout;
+    ctx->verbout  = verbout ? verbout : ctx->devnull;
+    ctx->debugout = debugout ? debugout : ctx->devnull;
+}
 
-    ret = libusb_get_configuration(devHandle, &currentConfig);
-    if(ret) {
-        fprintf(stderr, "Failed to get current device configuration: '%s'\n", strerror(-ret));
-        return NULL;
-    }
+// --------------------------------------------------------------------------
+// ch341ctxSetCancel()
+//      share a cancel flag, e.g. one set by a signal handler for all contexts.
+//      transfers in progress finish cleanly and the operation fails once it is set
+void ch341ctxSetCancel(struct ch341ctx *ctx, volatile sig_atomic_t *cancel) {
+    ctx->cancel = cancel;
+}
 
-    if(currentConfig != DEFAULT_CONFIGURATION)
-        ret = libusb_set_configuration(devHandle, currentConfig);
+// --------------------------------------------------------------------------
+// ch341tuningDefaults()
+//      the tuning of a new context
+void ch341tuningDefaults(struct ch341tuning *tuning) {
+    tuning->readqueuedepth  = DEFAULT_READ_QUEUE_DEPTH;
+    tuning->readsequential  = FALSE;
+    tuning->writeackpoll    = TRUE;
+    tuning->writebatch      = 1;
+    tuning->writeverify     = FALSE;
+    tuning->writecycledelay = WRITE_CYCLE_DELAY;
+    tuning->progressmode    = PROGRESS_AUTO;
+}
 
-    if(ret) {
-        fprintf(stderr, "Failed to set device configuration to %d: '%s'\n", DEFAULT_CONFIGURATION, strerror(-ret));
-        return NULL;
-    }
+// --------------------------------------------------------------------------
+// ch341configure()
+//      lock USB device for exclusive use
+//      claim default interface
+//      set default configuration
+//      retrieve device descriptor
+//      identify device revision
+// the first device found becomes the adapter of ctx, returns 0 on success, -1 on error
 
-    ret = libusb_claim_interface(devHandle, DEFAULT_INTERFACE); // interface 0
+int32_t ch341configure(struct ch341ctx *ctx, uint16_t vid, uint16_t pid) {
+    struct libusb_device_handle *devHandle;
 
-    if(ret) {
-        fprintf(stderr, "Failed to claim interface %d: '%s'\n", DEFAULT_INTERFACE, strerror(-ret));
-        return NULL;
+    if(ctx->transport->open(ctx, vid, pid, &devHandle, 1) < 1) {
+        fprintf(stderr, "Couldn't open device [%04x:%04x]\n", vid, pid);
+        return -1;
     }
+    ctx->devHandle = devHandle;
+    return 0;
+}
 
-    fprintf(verbout, "Claimed device interface [%d]\n", DEFAULT_INTERFACE);
-
-    ret = libusb_get_descriptor(devHandle, LIBUSB_DT_DEVICE, 0x00, ch341DescriptorBuffer, 0x12);
-
-    if(ret < 0) {
-        fprintf(stderr, "Failed to get device descriptor: '%s'\n", strerror(-ret));
-        return NULL;
+// --------------------------------------------------------------------------
+// ch341configureAll()
+//      open and claim every CH341 reachable through ctx, up to max of them, each
+//      in a context of its own with the transport, tuning, streams and cancel
+//      flag of ctx. every context opens the next adapter not yet claimed on a
+//      libusb context of its own, so the callbacks of each adapter only ever
+//      run on the thread that waits for them. free them before ctx
+//      returns the number of contexts in adapters
+int32_t ch341configureAll(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct ch341ctx **adapters, int32_t max) {
+    struct ch341ctx *adapter;
+    int32_t n = 0;
+
+    while(n < MIN(max, MAX_GANG_ADAPTERS)) {
+        if(!(adapter = ch341ctxNew(NULL))) {
+            fprintf(stderr, "Couldnt allocate the context of adapter [%d]\n", n);
+            break;
+        }
+        adapter->transport = ctx->transport;
+        adapter->tuning    = ctx->tuning;
+        adapter->cancel    = ctx->cancel;
+        ch341ctxSetOutput(adapter, ctx->msgout, ctx->verbout, ctx->debugout);
+        if((adapter->emu = ctx->emu)) {
+            pthread_mutex_lock(&ctx->emu->lock);
+            ctx->emu->refs++;
+            pthread_mutex_unlock(&ctx->emu->lock);
+        }
+        if(ctx->transport->open(adapter, vid, pid, &adapter->devHandle, 1) < 1) {
+            ch341ctxFree(adapter);                  // none left
+            break;
+        }
+        adapters[n++] = adapter;
     }
-
-    fprintf(verbout, "Device reported its revision [%d.%02d]\n",
-        ch341DescriptorBuffer[12], ch341DescriptorBuffer[13]);
-
-    for(i=0;i<0x12;i++)
-        fprintf(debugout,"%02x ", ch341DescriptorBuffer[i]);
-    fprintf(debugout,"\n");
-
-    return devHandle;
+    return n;
 }
 
 
 // --------------------------------------------------------------------------
 //  ch341setstream()
 //      set the i2c bus speed (speed: 0 = 20kHz; 1 = 100kHz, 2 = 400kHz, 3 = 750kHz)
-int32_t ch341setstream(struct libusb_device_handle *devHandle, uint32_t speed) {
+int32_t ch341setstream(struct ch341ctx *ctx, uint32_t speed) {
     int32_t ret, i;
     uint8_t ch341outBuffer[EEPROM_READ_BULKOUT_BUF_SZ], *outptr;
     int32_t actuallen = 0;
@@ -148,292 +188,1265 @@ int32_t ch341setstream(struct libusb_device_handle *devHandle, uint32_t speed) {
     *outptr++ = mCH341A_CMD_I2C_STM_SET | (speed & 0x3);
     *outptr   = mCH341A_CMD_I2C_STM_END;
 
-    ret = libusb_bulk_transfer(devHandle, BULK_WRITE_ENDPOINT, ch341outBuffer, 3, &actuallen, DEFAULT_TIMEOUT);
+    ret = ctx->transport->bulk(ctx, BULK_WRITE_ENDPOINT, ch341outBuffer, 3, &actuallen, DEFAULT_TIMEOUT);
 
     if(ret < 0) {
       fprintf(stderr, "ch341setstream(): Failed write %d bytes '%s'\n", 3, strerror(-ret));
       return -1;
     }
 
-    fprintf(debugout, "ch341setstream(): Wrote %d bytes: ", 3);
+    fprintf(ctx->debugout, "ch341setstream(): Wrote %d bytes: ", 3);
     for(i=0; i < 3; i++)
-        fprintf(debugout, "%02x ", ch341outBuffer[i]);
-    fprintf(debugout, "\n");
+        fprintf(ctx->debugout, "%02x ", ch341outBuffer[i]);
+    fprintf(ctx->debugout, "\n");
     return 0;
 }
 
-size_t ch341ReadCmdMarshall(uint8_t *buffer, uint32_t addr, struct EEPROM *eeprom_info) {
+// --------------------------------------------------------------------------
+// ch341ReadCmdMarshall()
+//      build the BULK OUT command reading len (up to 0x80) bytes at addr
+//      one stream frame per 32 byte USB packet, each returns one BULK IN packet
+//      start: open the i2c transaction and program the data address first
+//      stop:  NACK the last byte and close the transaction
+//      without them the block just continues a sequential read of the previous one
+size_t ch341ReadCmdMarshall(uint8_t *buffer, uint32_t addr, uint32_t len, uint8_t start, uint8_t stop, struct EEPROM *eeprom_info) {
     uint8_t *ptr = buffer;
+    uint8_t msb_addr, chunk;
+    uint32_t frame;
+
+    for(frame = 0; len; frame++) {
+        ptr = &buffer[frame * mCH341_PACKET_LENGTH];
+        chunk = MIN(len, EEPROM_READ_BULKIN_BUF_SZ);
+        len -= chunk;
+
+        *ptr++ = mCH341A_CMD_I2C_STREAM; // 0
+        if (frame == 0 && start) {
+            // Frame 1. Program data address
+            *ptr++ = mCH341A_CMD_I2C_STM_STA; // 1
+            // Write address
+            *ptr++ = mCH341A_CMD_I2C_STM_OUT | ((*eeprom_info).addr_size+1); // 2: I2C bus adddress + EEPROM address
+            if ((*eeprom_info).addr_size >= 2) {
+                // 24C32 and more
+                msb_addr = (addr>>16 & 1) | eeprom_info->addr;
+                *ptr++ = (EEPROM_I2C_BUS_ADDRESS | msb_addr)<<1; // 3
+                *ptr++ = (addr>>8 & 0xFF); // 4
+                *ptr++ = (addr>>0 & 0xFF); // 5
+            } else {
+                // 24C16 and less
+                msb_addr = (addr>>8 & 7) | eeprom_info->addr;
+                *ptr++ = (EEPROM_I2C_BUS_ADDRESS | msb_addr)<<1; // 3
+                *ptr++ = (addr>>0 & 0xFF); // 4
+            }
+            *ptr++ = mCH341A_CMD_I2C_STM_STA; // 6/5
+            *ptr++ = mCH341A_CMD_I2C_STM_OUT | 1; // 7/6
+            *ptr++ = (EEPROM_I2C_BUS_ADDRESS | msb_addr)<<1 | 1; // 8/7: Read command
+        }
 
-    // Frame 1. Program data address, and read 32 bytes.
-    *ptr++ = mCH341A_CMD_I2C_STREAM; // 0
-    *ptr++ = mCH341A_CMD_I2C_STM_STA; // 1
-    // Write address
-    *ptr++ = mCH341A_CMD_I2C_STM_OUT | ((*eeprom_info).addr_size+1); // 2: I2C bus adddress + EEPROM address
-    uint8_t msb_addr;
-    if ((*eeprom_info).addr_size >= 2) {
-        // 24C32 and more
-        msb_addr = (addr>>16 & 1) | eeprom_info->addr;
-        *ptr++ = (EEPROM_I2C_BUS_ADDRESS | msb_addr)<<1; // 3
-        *ptr++ = (addr>>8 & 0xFF); // 4
-        *ptr++ = (addr>>0 & 0xFF); // 5
-    } else {
-        // 24C16 and less
-         msb_addr = (addr>>8 & 7) | eeprom_info->addr;      
-        *ptr++ = (EEPROM_I2C_BUS_ADDRESS | msb_addr)<<1; // 3
-        *ptr++ = (addr>>0 & 0xFF); // 4
+        if (!len && stop) {
+            // Finalize - NACK the last byte and release the bus
+            if (chunk > 1)
+                *ptr++ = mCH341A_CMD_I2C_STM_IN | (chunk-1);
+            *ptr++ = mCH341A_CMD_I2C_STM_IN;
+            *ptr++ = mCH341A_CMD_I2C_STM_STO;
+        } else {
+            *ptr++ = mCH341A_CMD_I2C_STM_IN | chunk;
+        }
+        *ptr++ = mCH341A_CMD_I2C_STM_END;
     }
-    *ptr++ = mCH341A_CMD_I2C_STM_STA; // 6/5
-    *ptr++ = mCH341A_CMD_I2C_STM_OUT | 1; // 7/6
-    *ptr++ = (EEPROM_I2C_BUS_ADDRESS | msb_addr)<<1 | 1; // 8/7: Read command
 
-    // Read 32 bytes
-    *ptr++ = mCH341A_CMD_I2C_STM_IN | 32; // 9/8
-    *ptr++ = mCH341A_CMD_I2C_STM_END; // 10/9
+    return ptr - buffer;
+}
 
-    // Frame 2 - read 32 bytes
-    ptr = &buffer[32];
-    *ptr++ = mCH341A_CMD_I2C_STREAM;
-    *ptr++ = mCH341A_CMD_I2C_STM_IN | 32;
-    *ptr++ = mCH341A_CMD_I2C_STM_END;
+// --------------------------------------------------------------------------
+// ch341readRegionSize()
+//      returns the span a sequential read can cover before the device select
+//      bits change: 256 byte blocks for the 24c04..24c16, 64k for the 24c1024
+uint32_t ch341readRegionSize(struct EEPROM *eeprom_info) {
+    if((*eeprom_info).addr_size >= 2)
+        return 0x10000;
+    return 0x100;
+}
 
-    // Frame 3 - read 32 bytes
-    ptr = &buffer[64];
-    *ptr++ = mCH341A_CMD_I2C_STREAM;
-    *ptr++ = mCH341A_CMD_I2C_STM_IN | 32;
-    *ptr++ = mCH341A_CMD_I2C_STM_END;
+// --------------------------------------------------------------------------
+// ch341readCoalesce()
+//      sort ranges by offset and merge those that overlap or lie less than
+//      gap bytes apart, reading through a short gap is cheaper than a new
+//      i2c transaction. returns the number of ranges left
+int ch341rangeCompare(const void *a, const void *b) {
+    const struct ch341range *ra = a, *rb = b;
+
+    return (ra->offset > rb->offset) - (ra->offset < rb->offset);
+}
 
-    // Finalize - read last 32 bytes
-    ptr = &buffer[96];
-    *ptr++ = mCH341A_CMD_I2C_STREAM;
-    *ptr++ = mCH341A_CMD_I2C_STM_IN | 31;
-    *ptr++ = mCH341A_CMD_I2C_STM_IN;
-    *ptr++ = mCH341A_CMD_I2C_STM_STO;
-    *ptr++ = mCH341A_CMD_I2C_STM_END;
+uint32_t ch341readCoalesce(struct ch341range *ranges, uint32_t nranges, uint32_t gap) {
+    uint32_t i, n = 0;
 
-    return ptr - buffer;
+    if(!nranges)
+        return 0;
+    qsort(ranges, nranges, sizeof(struct ch341range), ch341rangeCompare);
+
+    for(i=1; i < nranges; i++) {
+        if(ranges[i].offset <= ranges[n].offset + ranges[n].length + gap)
+            ranges[n].length = MAX(ranges[n].offset + ranges[n].length, ranges[i].offset + ranges[i].length) - ranges[n].offset;
+        else
+            ranges[++n] = ranges[i];
+    }
+    return n + 1;
 }
 
 // --------------------------------------------------------------------------
-// ch341readEEPROM()
-//      read n bytes from device (in packets of 32 bytes)
-int32_t ch341readEEPROM(struct libusb_device_handle *devHandle, uint8_t *buffer, uint32_t bytestoread, struct EEPROM *eeprom_info) {
-
-    uint8_t ch341outBuffer[EEPROM_READ_BULKOUT_BUF_SZ];
-    uint8_t ch341inBuffer[IN_BUF_SZ];               // 0x100 bytes
-    int32_t ret = 0, readpktcount = 0;
-    struct libusb_transfer *xferBulkIn, *xferBulkOut;
-    struct timeval tv = {0, 100};                   // our async polling interval
+// ch341readSubmitBlock()
+//      queue the BULK IN requests and the BULK OUT read command for the next
+//      block (up to 0x80 bytes) of EEPROM data, using the transfers of a free slot
+//      each transfer is counted in flight before it is queued, so that its
+//      callback can never see the counts without it
+void ch341readSubmitBlock(struct ch341readslot *slot) {
+    struct ch341readstate *state = slot->state;
+    struct ch341range *range = &state->ranges[state->rangeidx];
+    uint32_t region = ch341readRegionSize(state->eeprom_info);
+    uint32_t end = range->offset + range->length;
+    uint8_t start, stop;
     size_t xfer_size;
+    int32_t ret, i;
+                                                    // a block never crosses into the next region
+    slot->offset = state->nextaddr;
+    slot->length = MIN(EEPROM_READ_BLOCK_SZ, MIN(end, (slot->offset / region + 1) * region) - slot->offset);
+    slot->npkts  = (slot->length + EEPROM_READ_BULKIN_BUF_SZ - 1) / EEPROM_READ_BULKIN_BUF_SZ;
+    slot->data   = state->buffer ? state->buffer + slot->offset : slot->bounce;
+
+    state->nextaddr += slot->length;
+                                                    // in sequential mode only the first block of a range or
+                                                    // region sends the address, and only its last block the STOP
+    start = !state->ctx->tuning.readsequential || slot->offset == range->offset || !(slot->offset % region);
+    stop  = !state->ctx->tuning.readsequential || state->nextaddr == end || !(state->nextaddr % region);
+
+    state->open = !stop;
+    if(state->nextaddr == end && ++state->rangeidx < state->nranges)
+        state->nextaddr = state->ranges[state->rangeidx].offset;
+
+    xfer_size = ch341ReadCmdMarshall(slot->outbuf, slot->offset, slot->length, start, stop, state->eeprom_info); // Fill output buffer
+                                                    // BULK IN packets land straight at their place in the buffer
+    for(i=0; i < slot->npkts; i++) {
+        libusb_fill_bulk_transfer(slot->xferBulkIn[i], state->ctx->devHandle, BULK_READ_ENDPOINT,
+            slot->data + i*EEPROM_READ_BULKIN_BUF_SZ, MIN(EEPROM_READ_BULKIN_BUF_SZ, slot->length - i*EEPROM_READ_BULKIN_BUF_SZ),
+            cbBulkIn, slot, state->timeout);
+        slot->pending++;
+        slot->inpending++;
+        state->inflight++;
+        if((ret = state->ctx->transport->submit(slot->xferBulkIn[i])) < 0) {
+            slot->pending--;
+            slot->inpending--;
+            state->inflight--;
+            fprintf(stderr, "Couldnt submit BULK IN transfer: '%s'\n", strerror(-ret));
+            state->error = -1;
+            return;
+        }
+    }
 
-    xferBulkIn  = libusb_alloc_transfer(0);
-    xferBulkOut = libusb_alloc_transfer(0);
+    libusb_fill_bulk_transfer(slot->xferBulkOut, state->ctx->devHandle, BULK_WRITE_ENDPOINT,
+        slot->outbuf, xfer_size, cbBulkOut, slot, state->timeout);
+    slot->pending++;
+    state->inflight++;
+    if((ret = state->ctx->transport->submit(slot->xferBulkOut)) < 0) {
+        slot->pending--;
+        state->inflight--;
+        fprintf(stderr, "Couldnt submit BULK OUT transfer: '%s'\n", strerror(-ret));
+        state->error = -1;
+        return;
+    }
 
-    if(!xferBulkIn || !xferBulkOut) {
-        fprintf(stderr, "Couldnt allocate USB transfer structures\n");
+    fprintf(state->ctx->debugout, "\nSubmitted read request for [%d] bytes at [%04x]\n", slot->length, slot->offset);
+}
+
+// --------------------------------------------------------------------------
+// ch341readSlotDone()
+//      called from the callbacks; once every transfer of a slot has completed,
+//      reuse the slot for the next block that still has to be requested.
+//      flags the read as completed when nothing is left in flight or on error
+void ch341readSlotDone(struct ch341readslot *slot) {
+    struct ch341readstate *state = slot->state;
+
+    if(!slot->pending && !state->error && !state->stopping && state->rangeidx < state->nranges)
+        ch341readSubmitBlock(slot);
+    if(!state->inflight || state->error)
+        state->completed = 1;
+}
+
+// --------------------------------------------------------------------------
+// ch341readClose()
+//      end a sequential read an early exit left open: the EEPROM was ACKed for
+//      another byte and keeps driving SDA until it is NACKed, which would make
+//      the next START fail. reads one more byte with a NACK and sends the STOP
+int32_t ch341readClose(struct ch341ctx *ctx) {
+    uint8_t ch341outBuffer[4], ch341inBuffer[EEPROM_READ_BULKIN_BUF_SZ];
+    int32_t ret, actuallen = 0;
+
+    ch341outBuffer[0] = mCH341A_CMD_I2C_STREAM;
+    ch341outBuffer[1] = mCH341A_CMD_I2C_STM_IN;         // IN with no length NACKs the byte
+    ch341outBuffer[2] = mCH341A_CMD_I2C_STM_STO;
+    ch341outBuffer[3] = mCH341A_CMD_I2C_STM_END;
+
+    if((ret = ctx->transport->bulk(ctx, BULK_WRITE_ENDPOINT, ch341outBuffer, sizeof(ch341outBuffer), &actuallen, DEFAULT_TIMEOUT)) < 0 ||
+       (ret = ctx->transport->bulk(ctx, BULK_READ_ENDPOINT, ch341inBuffer, sizeof(ch341inBuffer), &actuallen, DEFAULT_TIMEOUT)) < 0) {
+        fprintf(stderr, "Couldnt close the sequential read: '%s'\n", strerror(-ret));
         return -1;
     }
+    fprintf(ctx->debugout, "Closed the sequential read left open by the early exit\n");
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341cancelTransfer()
+//      cancel a transfer on error, skipping the ones that were never filled in
+void ch341cancelTransfer(struct ch341ctx *ctx, struct libusb_transfer *transfer) {
+    if(transfer && transfer->dev_handle)
+        ctx->transport->cancel(transfer);
+}
 
-    byteoffset = 0;
+// --------------------------------------------------------------------------
+// ch341drainBulkIn()
+//      after transfers were cancelled on error, read and drop what the CH341
+//      still returns for the commands it had already been sent, so the next
+//      job on the adapter does not take it for its own reply
+void ch341drainBulkIn(struct ch341ctx *ctx) {
+    uint8_t buf[EEPROM_READ_BULKIN_BUF_SZ];
+    int actuallen, i;
+
+    for(i=0; i < MAX_READ_QUEUE_DEPTH * EEPROM_READ_PKTS_PER_BLOCK; i++)
+        if(ctx->transport->bulk(ctx, BULK_READ_ENDPOINT, buf, sizeof(buf), &actuallen, DRAIN_TIMEOUT) < 0 || !actuallen)
+            break;
+    if(i)
+        fprintf(ctx->debugout, "Dropped [%d] BULK IN packets left over after the error\n", i);
+}
 
-    fprintf(debugout, "Allocated USB transfer structures\n");
+// --------------------------------------------------------------------------
+// ch341readEEPROM()
+//      read n bytes from the start of the device
+int32_t ch341readEEPROM(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytestoread, struct EEPROM *eeprom_info) {
+    struct ch341range range = {0, bytestoread};
 
-    memset(ch341inBuffer, 0, EEPROM_READ_BULKIN_BUF_SZ);
-    xfer_size = ch341ReadCmdMarshall(ch341outBuffer, 0, eeprom_info); // Fill output buffer
+    return ch341readRanges(ctx, buffer, &range, 1, eeprom_info, NULL, NULL);
+}
 
-    libusb_fill_bulk_transfer(xferBulkIn,  devHandle, BULK_READ_ENDPOINT, ch341inBuffer,
-        EEPROM_READ_BULKIN_BUF_SZ, cbBulkIn, NULL, DEFAULT_TIMEOUT);
+// --------------------------------------------------------------------------
+// ch341readRanges()
+//      read a list of address ranges from the device (in packets of 32 bytes)
+//      into buffer, which is indexed by EEPROM address. nearby ranges are
+//      coalesced into fewer transactions, the list is sorted in place
+//      up to readqueuedepth blocks of 0x80 bytes are kept in flight, so the read
+//      command for the next block is already queued while the current one arrives
+//      blockcb (if not NULL) is called in address order as each block lands in
+//      buffer; returning < 0 from it aborts the read. with a NULL buffer the
+//      blocks land in a block sized bounce buffer of their slot and are only
+//      handed to blockcb, so a scan needs no chip sized buffer. blocks already requested
+//      are still received (and dropped) then, as the CH341 returns them anyway,
+//      and a sequential read stopped within a region is closed on the bus
+int32_t ch341readRanges(struct ch341ctx *ctx, uint8_t *buffer, struct ch341range *ranges, uint32_t nranges, struct EEPROM *eeprom_info,
+                        ch341blockcb blockcb, void *cbarg) {
+
+    struct ch341readstate state;
+    struct ch341readslot *slots;
+    struct timeval tv = {1, 0};                     // upper bound on a wait, the callbacks wake us first
+    uint32_t bytestoread = 0;
+    int32_t ret = 0, depth, i, j;
+
+    nranges = ch341readCoalesce(ranges, nranges, READ_RANGE_MERGE_GAP);
+    for(i=0; i < nranges; i++)
+        bytestoread += ranges[i].length;
+    if(!bytestoread)
+        return 0;
+
+    depth = MIN(MAX(ctx->tuning.readqueuedepth, 1), MAX_READ_QUEUE_DEPTH);
+    depth = MIN(depth, (bytestoread + EEPROM_READ_BLOCK_SZ - 1) / EEPROM_READ_BLOCK_SZ);
+
+    memset(&state, 0, sizeof(state));
+    state.ctx         = ctx;
+    state.eeprom_info = eeprom_info;
+    state.buffer      = buffer;
+    state.ranges      = ranges;
+    state.nranges     = nranges;
+    state.nextaddr    = ranges[0].offset;
+    state.bytestoread = bytestoread;
+    state.timeout     = DEFAULT_TIMEOUT * depth;    // queued requests wait for the blocks ahead of them
+    state.blockcb     = blockcb;
+    state.cbarg       = cbarg;
+
+    if(!(slots = (struct ch341readslot *) calloc(depth, sizeof(struct ch341readslot)))) {
+        fprintf(stderr, "Couldnt allocate USB transfer structures\n");
+        return -1;
+    }
 
-    libusb_fill_bulk_transfer(xferBulkOut, devHandle, BULK_WRITE_ENDPOINT,
-        ch341outBuffer, xfer_size, cbBulkOut, NULL, DEFAULT_TIMEOUT);
+    for(i=0; i < depth; i++) {
+        slots[i].state = &state;
+        if(!(slots[i].xferBulkOut = ctx->transport->alloc()))
+            state.error = -1;
+        for(j=0; j < EEPROM_READ_PKTS_PER_BLOCK; j++)
+            if(!(slots[i].xferBulkIn[j] = ctx->transport->alloc()))
+                state.error = -1;
+    }
 
-    fprintf(debugout, "Filled USB transfer structures\n");
+    if(state.error) {
+        fprintf(stderr, "Couldnt allocate USB transfer structures\n");
+        goto out;
+    }
+
+    fprintf(ctx->debugout, "Allocated USB transfer structures for [%d] blocks in flight\n", depth);
+    fprintf(ctx->verbout, "Reading [%d] bytes in [%d] address ranges\n", bytestoread, nranges);
 
-    libusb_submit_transfer(xferBulkIn);
-    fprintf(debugout, "Submitted BULK IN start packet\n");
-    libusb_submit_transfer(xferBulkOut);
-    fprintf(debugout, "Submitted BULK OUT setup packet\n");
+    ch341progressStart(&state.progress, ctx, "Read", "read", bytestoread);
 
-    readbuf = buffer;
+    for(i=0; i < depth && !state.error && state.rangeidx < state.nranges; i++)
+        ch341readSubmitBlock(&slots[i]);
 
-    while (1) {
-        fprintf(stdout, "Read %d%% [%d] of [%d] bytes      \r", 100*byteoffset/bytestoread, byteoffset, bytestoread);
-		ret = libusb_handle_events_timeout(NULL, &tv);
+    while(!state.completed && !state.error) {       // sleep until a callback reports completion
+        ch341progressUpdate(&state.progress, state.bytesdone);
+        ret = ctx->transport->events(ctx, &tv, &state.completed);
 
-		if (ret < 0 || getnextpkt == -1) {          // indicates an error
+        if(*ctx->cancel && !state.stopping) {
+            fprintf(stderr, "Read interrupted\n");
+            state.stopping = 1;
+        } else if(ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) { // indicates an error
             fprintf(stderr, "ret from libusb_handle_timeout = %d\n", ret);
-            fprintf(stderr, "getnextpkt = %d\n", getnextpkt);
-            if (ret < 0)
-                fprintf(stderr, "USB read error : %s\n", strerror(-ret));
-            libusb_free_transfer(xferBulkIn);
-            libusb_free_transfer(xferBulkOut);
-            return -1;
+            fprintf(stderr, "USB read error : %s\n", strerror(-ret));
+            state.error = -1;
         }
-        if(getnextpkt == 1) {                       // callback function reports a new BULK IN packet received
-            getnextpkt = 0;                         //   reset the flag
-            readpktcount++;                         //   increment the read packet counter
-            byteoffset += EEPROM_READ_BULKIN_BUF_SZ;
-            if (byteoffset == bytestoread)
-                break;
+    }
 
-            fprintf(debugout, "\nRe-submitting transfer request to BULK IN endpoint\n");
-            libusb_submit_transfer(xferBulkIn);     // re-submit request for next BULK IN packet of EEPROM data
-            if(syncackpkt)
-                syncackpkt = 0;
-                                                    // if 4th packet received, we are at end of 0x80 byte data block,
-                                                    // if it is not the last block, then resubmit request for data
-            if(readpktcount==4) {
-                fprintf(debugout, "\nSubmitting next transfer request to BULK OUT endpoint\n");
-                readpktcount = 0;
-
-                ch341ReadCmdMarshall(ch341outBuffer, byteoffset, eeprom_info); // Fill output buffer
-                libusb_fill_bulk_transfer(xferBulkOut, devHandle, BULK_WRITE_ENDPOINT, ch341outBuffer,
-                                    EEPROM_READ_BULKOUT_BUF_SZ, cbBulkOut, NULL, DEFAULT_TIMEOUT);
-
-                libusb_submit_transfer(xferBulkOut);// update transfer struct (with new EEPROM page offset)
-                                                    // and re-submit next transfer request to BULK OUT endpoint
-            }
+    if(state.error) {                               // nothing may be left in flight when the transfers are freed
+        for(i=0; i < depth; i++) {
+            ch341cancelTransfer(ctx, slots[i].xferBulkOut);
+            for(j=0; j < EEPROM_READ_PKTS_PER_BLOCK; j++)
+                ch341cancelTransfer(ctx, slots[i].xferBulkIn[j]);
         }
-	}
-
-    libusb_free_transfer(xferBulkIn);
-    libusb_free_transfer(xferBulkOut);
-    return 0;
+        while(state.inflight > 0)
+            if(ctx->transport->events(ctx, &tv, NULL) < 0)
+                break;
+        ch341drainBulkIn(ctx);
+    } else if(state.stopping) {
+        if(state.open)                              // in sequential mode the EEPROM is still sending
+            ch341readClose(ctx);
+        state.error = -1;
+    }
+    else
+        ch341progressEnd(&state.progress, state.bytesdone);
+
+out:
+    for(i=0; i < depth; i++) {
+        ctx->transport->free(slots[i].xferBulkOut);
+        for(j=0; j < EEPROM_READ_PKTS_PER_BLOCK; j++)
+            ctx->transport->free(slots[i].xferBulkIn[j]);
+    }
+    free(slots);
+    return state.error;
 }
 
 // Callback function for async bulk in comms
 void cbBulkIn(struct libusb_transfer *transfer) {
+    struct ch341readslot *slot = (struct ch341readslot *) transfer->user_data;
+    struct ch341readstate *state = slot->state;
     int i;
 
+    slot->pending--;
+    state->inflight--;
+
     switch(transfer->status) {
         case LIBUSB_TRANSFER_COMPLETED:
                                                     // display the contents of the BULK IN data buffer
-            fprintf(debugout,"\ncbBulkIn(): status %d - Read %d bytes\n",transfer->status,transfer->actual_length);
+            fprintf(state->ctx->debugout,"\ncbBulkIn(): status %d - Read %d bytes\n",transfer->status,transfer->actual_length);
 
             for(i=0; i < transfer->actual_length; i++) {
                 if(!(i%16))
-                    fprintf(debugout, "\n   ");
-                fprintf(debugout, "%02x ", transfer->buffer[i]);
+                    fprintf(state->ctx->debugout, "\n   ");
+                fprintf(state->ctx->debugout, "%02x ", transfer->buffer[i]);
             }
-            fprintf(debugout, "\n");
-                                                    // copy read data to our EEPROM buffer
-            memcpy(readbuf + byteoffset, transfer->buffer, transfer->actual_length);
-            getnextpkt = 1;
+            fprintf(state->ctx->debugout, "\n");
+
+            if(transfer->actual_length != transfer->length) {
+                fprintf(stderr, "\ncbBulkIn: short read of %d of %d bytes\n", transfer->actual_length, transfer->length);
+                state->error = -1;
+                break;
+            }
+            state->bytesdone += transfer->length;
+                                                    // BULK IN packets complete in the order they were
+                                                    // queued, so blocks are handed on in address order
+            if(!--slot->inpending && state->blockcb && !state->error && !state->stopping)
+                if(state->blockcb(slot->offset, slot->data, slot->length, state->cbarg) < 0)
+                    state->stopping = 1;
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
             break;
         default:
             fprintf(stderr, "\ncbBulkIn: error : %d\n", transfer->status);
-            getnextpkt = -1;
+            state->error = -1;
     }
+    ch341readSlotDone(slot);
 	return;
 }
 
 // Callback function for async bulk out comms
 void cbBulkOut(struct libusb_transfer *transfer) {
-    syncackpkt = 1;
-    fprintf(debugout, "\ncbBulkOut(): Sync/Ack received: status %d\n", transfer->status);
+    struct ch341readslot *slot = (struct ch341readslot *) transfer->user_data;
+    struct ch341readstate *state = slot->state;
+
+    slot->pending--;
+    state->inflight--;
+
+    fprintf(state->ctx->debugout, "\ncbBulkOut(): Sync/Ack received: status %d\n", transfer->status);
+    if(transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "\ncbBulkOut: error : %d\n", transfer->status);
+        state->error = -1;
+    }
+    ch341readSlotDone(slot);
     return;
 }
+// Callback function for the BULK OUT transfers of a write, pages and ACK polls
+void cbWriteOut(struct libusb_transfer *transfer) {
+    struct ch341writeslot *slot = (struct ch341writeslot *) transfer->user_data;
+    struct ch341writestate *state = slot->state;
+
+    slot->pending--;
+    state->inflight--;
+
+    fprintf(state->ctx->debugout, "\ncbWriteOut(): status %d - Wrote %d of %d bytes\n", transfer->status, transfer->actual_length, transfer->length);
+    if(transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length != transfer->length) {
+        fprintf(stderr, "\ncbWriteOut: short write of %d of %d bytes\n", transfer->actual_length, transfer->length);
+        state->error = -1;
+    } else if(transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "\ncbWriteOut: error : %d\n", transfer->status);
+        state->error = -1;
+    }
+    ch341writeSlotDone(slot);
+}
+
+// Callback function for the BULK IN packets of a write readback
+void cbWriteVerifyIn(struct libusb_transfer *transfer) {
+    struct ch341writeslot *slot = (struct ch341writeslot *) transfer->user_data;
+    struct ch341writestate *state = slot->state;
+
+    slot->pending--;
+    state->inflight--;
+
+    fprintf(state->ctx->debugout, "\ncbWriteVerifyIn(): status %d - Read %d bytes\n", transfer->status, transfer->actual_length);
+    if(transfer->status == LIBUSB_TRANSFER_COMPLETED && transfer->actual_length != transfer->length) {
+        fprintf(stderr, "\ncbWriteVerifyIn: short read of %d of %d bytes\n", transfer->actual_length, transfer->length);
+        state->error = -1;
+    } else if(transfer->status != LIBUSB_TRANSFER_COMPLETED && transfer->status != LIBUSB_TRANSFER_CANCELLED) {
+        fprintf(stderr, "\ncbWriteVerifyIn: error : %d\n", transfer->status);
+        state->error = -1;
+    }
+    ch341writeSlotDone(slot);
+}
+
+// Callback function for the ACK status of a poll, polls again while the device is busy
+void cbWritePollIn(struct libusb_transfer *transfer) {
+    struct ch341writeslot *slot = (struct ch341writeslot *) transfer->user_data;
+    struct ch341writestate *state = slot->state;
+    double now = ch341progressNow();
+
+    slot->pending--;
+    state->inflight--;
+
+    switch(transfer->status) {
+        case LIBUSB_TRANSFER_COMPLETED:
+            if(transfer->actual_length != 1) {
+                fprintf(stderr, "\ncbWritePollIn: short read of %d bytes\n", transfer->actual_length);
+                state->error = -1;
+                break;
+            }
+            if(!(slot->status & 0x80)) {                // bit 7 clear: device acknowledged
+                fprintf(state->ctx->debugout, "Write cycle at [%04x] done after %d polls\n", slot->polled.offset, slot->polls);
+                break;
+            }
+            if(!slot->deadline)                         // the first status arrives once the page is on the chip
+                slot->deadline = now + ACK_POLL_TIMEOUT / 1000.0;
+            if(now > slot->deadline) {
+                fprintf(stderr, "EEPROM did not acknowledge within %dms after writing address [%04x]\n", ACK_POLL_TIMEOUT, slot->polled.offset);
+                state->error = -1;
+            } else if(!state->error && !*state->ctx->cancel)
+                ch341writeSubmitPoll(slot);
+            break;
+        case LIBUSB_TRANSFER_CANCELLED:
+            break;
+        default:
+            fprintf(stderr, "\ncbWritePollIn: error : %d\n", transfer->status);
+            state->error = -1;
+    }
+    ch341writeSlotDone(slot);
+}
+
+// --------------------------------------------------------------------------
+// ch341WriteCmdMarshall()
+//      build the BULK OUT command writing len bytes at addr in one i2c transaction
+//      one stream frame per 32 byte USB packet, the caller keeps the bytes
+//      within a single page
+size_t ch341WriteCmdMarshall(uint8_t *buffer, uint32_t addr, uint8_t *data, uint32_t len, struct EEPROM *eeprom_info) {
+    uint8_t i2cCmdBuffer[EEPROM_MAX_PAGE_SZ + 3];
+    uint8_t *ptr = i2cCmdBuffer, *i2cBufPtr = i2cCmdBuffer;
+    uint32_t left, room, chunk, frame;
+
+    *ptr++ = ch341i2cAddress(eeprom_info, addr);        // EEPROM device address
+    if ((*eeprom_info).addr_size >= 2)
+        *ptr++ = (uint8_t) (addr >> 8 & 0xff);          // MSB (big-endian) byte address
+    *ptr++ = (uint8_t) (addr & 0xff);                   // LSB of byte address
+    memcpy(ptr, data, len);
+    left = len + (ptr - i2cCmdBuffer);
+
+    for(frame = 0; left; frame++) {
+        ptr = &buffer[frame * mCH341_PACKET_LENGTH];
+        room = mCH341_PACKET_LENGTH - 3 - (frame == 0);   // STREAM, OUT, END and the first START
+        chunk = MIN(left, room);
+        if(chunk == left && chunk == room)              // leave space for the STOP
+            chunk--;
+        left -= chunk;
+
+        *ptr++ = mCH341A_CMD_I2C_STREAM;
+        if (frame == 0)
+            *ptr++ = mCH341A_CMD_I2C_STM_STA;
+        *ptr++ = mCH341A_CMD_I2C_STM_OUT | chunk;
+        memcpy(ptr, i2cBufPtr, chunk);
+        ptr += chunk;
+        i2cBufPtr += chunk;
+        if (!left)
+            *ptr++ = mCH341A_CMD_I2C_STM_STO;           // starts the write cycle
+        *ptr++ = mCH341A_CMD_I2C_STM_END;
+    }
+
+    return ptr - buffer;
+}
 
 // --------------------------------------------------------------------------
 // ch341writeEEPROM()
-//      write n bytes to 24c32/24c64 device (in packets of 32 bytes)
-int32_t ch341writeEEPROM(struct libusb_device_handle *devHandle, uint8_t *buffer, uint32_t bytesum, struct EEPROM *eeprom_info) {
-
-    uint8_t ch341outBuffer[512/*EEPROM_WRITE_BUF_SZ*/];
-    uint8_t *outptr, *bufptr;
-    uint8_t i2cCmdBuffer[256];
-    int32_t ret = 0, i;
-    uint32_t byteoffset = 0;
-    uint32_t bytes = bytesum;
-    uint8_t addrbytecount = (*eeprom_info).addr_size+1;  // 24c32 and 24c64 (and other 24c??) use 3 bytes for addressing
-    int32_t actuallen = 0;
-    uint16_t page_size = (*eeprom_info).page_size;
+//      write n bytes to the start of the device
+int32_t ch341writeEEPROM(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytesum, struct EEPROM *eeprom_info) {
+    struct ch341range range = {0, bytesum};
 
-    bufptr = buffer;
+    return ch341writeRanges(ctx, buffer, &range, 1, eeprom_info);
+}
 
-    while(bytes) {
-        outptr = i2cCmdBuffer;
-        if ((*eeprom_info).addr_size >= 2) {
-          *outptr++ = (uint8_t) (0xa0 | (((byteoffset >> 16) & 1) | eeprom_info->addr)<<1);  // EEPROM device address
-            *outptr++ = (uint8_t) (byteoffset >> 8 & 0xff);     // MSB (big-endian) byte address
-        } else {
-          *outptr++ = (uint8_t) (0xa0 | (((byteoffset >> 8) & 7) | eeprom_info->addr)<<1);  // EEPROM device address
+// --------------------------------------------------------------------------
+// ch341writeRanges()
+//      write a list of address ranges from buffer, which is indexed by EEPROM address
+int32_t ch341writeRanges(struct ch341ctx *ctx, uint8_t *buffer, struct ch341range *ranges, uint32_t nranges, struct EEPROM *eeprom_info) {
+    return ch341writePages(ctx, buffer, 0, ranges, nranges, eeprom_info, NULL, 0);
+}
+
+// --------------------------------------------------------------------------
+// ch341writeTargets()
+//      write an image of bytes to each of several EEPROMs on the bus, told apart
+//      by the chip select in their addr. buffer holds the images interleaved a
+//      page at a time, the layout ch341writeTarget() decodes. every round sends
+//      the next page to each chip and waits out the write cycle once, ACK
+//      polling the first chip or with the fixed delay, so the chips go through
+//      their write cycles together
+int32_t ch341writeTargets(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytes, struct EEPROM *targets, uint32_t ntargets) {
+    struct ch341range range = {0, bytes * ntargets};
+
+    return ch341writePages(ctx, buffer, 0, &range, 1, &targets[0], targets, ntargets);
+}
+
+// --------------------------------------------------------------------------
+// ch341writeTarget()
+//      the device the write buffer address addr goes to. with several targets
+//      page n of the buffer is page n / ntargets of target n % ntargets
+//      sets *devaddr to the address within that device
+struct EEPROM *ch341writeTarget(struct ch341writestate *state, uint32_t addr, uint32_t *devaddr) {
+    uint16_t page_size = state->eeprom_info->page_size;
+    uint32_t page = addr / page_size;
+
+    if(!state->ntargets) {
+        *devaddr = addr;
+        return state->eeprom_info;
+    }
+    *devaddr = page / state->ntargets * page_size + addr % page_size;
+    return &state->targets[page % state->ntargets];
+}
+
+// --------------------------------------------------------------------------
+// ch341writePeekPage()
+//      the next page to write, pages to rewrite after a failed readback first
+//      returns 0 once nothing is left
+uint32_t ch341writePeekPage(struct ch341writestate *state, struct ch341range *page) {
+    uint16_t page_size = state->eeprom_info->page_size;
+    uint32_t end;
+
+    if(state->nretry) {
+        *page = state->retry[0];
+        return 1;
+    }
+    if(state->rangeidx >= state->nranges)
+        return 0;
+    end = state->ranges[state->rangeidx].offset + state->ranges[state->rangeidx].length;
+    page->offset = state->nextaddr;
+    page->length = MIN(end - state->nextaddr, page_size - state->nextaddr % page_size);  // never cross a page
+    return 1;
+}
+
+// --------------------------------------------------------------------------
+// ch341writeTakePage()
+//      move on past the page returned by ch341writePeekPage()
+void ch341writeTakePage(struct ch341writestate *state) {
+    struct ch341range page;
+
+    if(state->nretry) {
+        memmove(&state->retry[0], &state->retry[1], --state->nretry * sizeof(struct ch341range));
+        return;
+    }
+    ch341writePeekPage(state, &page);
+    state->nextaddr += page.length;
+    if(state->nextaddr == state->ranges[state->rangeidx].offset + state->ranges[state->rangeidx].length &&
+       ++state->rangeidx < state->nranges)
+        state->nextaddr = state->ranges[state->rangeidx].offset;
+}
+
+// --------------------------------------------------------------------------
+// ch341writeFillSlot()
+//      marshall the slot's next BULK OUT transfer: up to batch pages that
+//      fit the CH341 input buffer, each followed by an on-chip wait unless ACK
+//      polling. with several targets only the last page of a round waits, or
+//      when ACK polling the round is polled on the first of its chips
+//      when verifying, each page is read back after its wait, or with
+//      ACK polling at the start of the next transfer. returns the transfer size,
+//      0 once nothing is left
+size_t ch341writeFillSlot(struct ch341writeslot *slot) {
+    struct ch341writestate *state = slot->state;
+    uint8_t pageBuffer[EEPROM_WRITE_BUF_SZ + mCH341_PACKET_LENGTH + EEPROM_MAX_PAGE_SZ];   // page, wait and readback
+    struct ch341range page;
+    struct EEPROM *target;
+    uint32_t npages = 0, readlen = 0, devaddr;
+    size_t len = 0, pagecmd;
+
+    slot->bytes = 0;
+    slot->written = FALSE;
+    slot->nreadback = 0;
+    slot->npkts = 0;
+    memset(slot->outbuf, 0, sizeof(slot->outbuf));
+
+    if(state->carry.length) {                       // its write cycle ended with the last poll
+        len = CH341_PKT_ALIGN(ch341ReadCmdMarshall(slot->outbuf, state->carry.offset, state->carry.length, TRUE, TRUE, state->eeprom_info));
+        slot->readback[slot->nreadback++] = state->carry;
+        readlen += state->carry.length;
+        state->carry.length = 0;
+    }
+
+    while(npages < state->batch && ch341writePeekPage(state, &page)) {
+        memset(pageBuffer, 0, sizeof(pageBuffer));
+        target = ch341writeTarget(state, page.offset, &devaddr);
+        pagecmd = ch341WriteCmdMarshall(pageBuffer, devaddr,
+                      state->buffer + (state->wrap ? page.offset % state->wrap : page.offset), page.length, target);
+        if(!state->ackpoll && (!state->ntargets || target == &state->targets[state->ntargets - 1])) {
+            pagecmd = CH341_PKT_ALIGN(pagecmd);         // the CH341 waits out the write cycle itself
+            pagecmd += ch341DelayCmdMarshall(pageBuffer + pagecmd, state->ctx->tuning.writecycledelay);
+            if(state->verify) {
+                pagecmd = CH341_PKT_ALIGN(pagecmd);
+                pagecmd += ch341ReadCmdMarshall(pageBuffer + pagecmd, page.offset, page.length, TRUE, TRUE, state->eeprom_info);
+            }
         }
-        *outptr++ = (uint8_t) (byteoffset & 0xff);          // LSB of 16-bit    byte address
-
-        memcpy(outptr, bufptr, page_size); // Copy one page
-
-        byteoffset += page_size;
-        bufptr     += page_size;
-        bytes      -= page_size;
-
-        outptr    = ch341outBuffer;
-        uint16_t page_size_left = page_size + addrbytecount;
-        uint8_t part_no = 0;
-        uint8_t *i2cBufPtr = i2cCmdBuffer;
-        while(page_size_left) {
-            uint8_t to_write = MIN(page_size_left, 28);
-            *outptr++ = mCH341A_CMD_I2C_STREAM;
-            if (part_no == 0) { // Start packet
-                *outptr++ = mCH341A_CMD_I2C_STM_STA;
+        pagecmd = CH341_PKT_ALIGN(pagecmd);
+        if(len + pagecmd + (state->ackpoll ? mCH341_PACKET_LENGTH : 0) > CH341_MAX_BULK_OUT_SZ)
+            break;
+
+        memcpy(slot->outbuf + len, pageBuffer, pagecmd);
+        len += pagecmd;
+        npages++;
+        if(state->verify && !state->ackpoll) {
+            slot->readback[slot->nreadback++] = page;
+            readlen += page.length;
+        }
+        if(!state->nretry)                              // rewrites were already counted
+            slot->bytes += page.length;
+        if(!slot->written)
+            slot->polled = page;
+        slot->page = page;
+        slot->written = TRUE;
+        ch341writeTakePage(state);
+    }
+
+    slot->npkts = (readlen + EEPROM_READ_BULKIN_BUF_SZ - 1) / EEPROM_READ_BULKIN_BUF_SZ;
+    return len;
+}
+
+// --------------------------------------------------------------------------
+// ch341writeSubmitSlot()
+//      queue the slot's next transfer and the BULK INs of its readback,
+//      followed by the first ACK poll when polling. as with reads, every
+//      transfer is counted in flight before it is queued
+void ch341writeSubmitSlot(struct ch341writeslot *slot) {
+    struct ch341writestate *state = slot->state;
+    size_t xfer_size, i;
+    uint32_t readlen = 0, off = 0, r;
+    int32_t ret;
+
+    if(!(xfer_size = ch341writeFillSlot(slot)))
+        return;
+
+    for(i=0; i < xfer_size; i++) {
+        if(!(i%0x10))
+            fprintf(state->ctx->debugout, "\n%04x : ", (uint32_t) i);
+        fprintf(state->ctx->debugout, "%02x ", slot->outbuf[i]);
+    }
+    fprintf(state->ctx->debugout, "\n");
+
+    for(r=0; r < slot->nreadback; r++)
+        readlen += slot->readback[r].length;
+                                                    // each readback packet holds up to 32 bytes, a page
+    for(r=0, i=0; r < slot->nreadback; r++) {       // never shares a packet with the next one
+        uint32_t end = off + slot->readback[r].length;
+        for(; off < end; off += EEPROM_READ_BULKIN_BUF_SZ, i++) {
+            libusb_fill_bulk_transfer(slot->xferVerifyIn[i], state->ctx->devHandle, BULK_READ_ENDPOINT,
+                slot->verifybuf + off, MIN(EEPROM_READ_BULKIN_BUF_SZ, end - off), cbWriteVerifyIn, slot, state->timeout);
+            slot->pending++;
+            state->inflight++;
+            if((ret = state->ctx->transport->submit(slot->xferVerifyIn[i])) < 0) {
+                slot->pending--;
+                state->inflight--;
+                fprintf(stderr, "Couldnt submit BULK IN transfer: '%s'\n", strerror(-ret));
+                state->error = -1;
+                return;
             }
-            *outptr++ = mCH341A_CMD_I2C_STM_OUT | to_write;
-            memcpy(outptr, i2cBufPtr, to_write);
-            outptr += to_write;
-            i2cBufPtr += to_write;
-            page_size_left -= to_write;
-
-            if (page_size_left == 0) { // Stop packet
-                *outptr++ = mCH341A_CMD_I2C_STM_STO;
+        }
+        off = end;
+    }
+
+    libusb_fill_bulk_transfer(slot->xferBulkOut, state->ctx->devHandle, BULK_WRITE_ENDPOINT,
+        slot->outbuf, xfer_size, cbWriteOut, slot, state->timeout);
+    slot->pending++;
+    state->inflight++;
+    if((ret = state->ctx->transport->submit(slot->xferBulkOut)) < 0) {
+        slot->pending--;
+        state->inflight--;
+        fprintf(stderr, "Couldnt submit BULK OUT transfer: '%s'\n", strerror(-ret));
+        state->error = -1;
+        return;
+    }
+
+    fprintf(state->ctx->debugout, "\nSubmitted write up to page [%04x], reading back [%d] bytes\n", slot->page.offset, readlen);
+
+    if(state->ackpoll && slot->written) {
+        slot->polls = 0;
+        slot->deadline = 0;
+        ch341writeSubmitPoll(slot);
+    }
+}
+
+// --------------------------------------------------------------------------
+// ch341writeSubmitPoll()
+//      queue an ACK poll of the device and the BULK IN carrying its status
+//      with several targets that is the chip written first in the round: each
+//      of the others started its write cycle as much later as its next page
+//      goes out after the first one's, so they are done by then too
+void ch341writeSubmitPoll(struct ch341writeslot *slot) {
+    struct ch341writestate *state = slot->state;
+    struct EEPROM *target;
+    uint32_t devaddr;
+    int32_t ret;
+
+    target = ch341writeTarget(state, slot->polled.offset, &devaddr);
+    libusb_fill_bulk_transfer(slot->xferPollOut, state->ctx->devHandle, BULK_WRITE_ENDPOINT,
+        slot->pollbuf, ch341PollCmdMarshall(slot->pollbuf, devaddr, target), cbWriteOut, slot, state->timeout);
+    libusb_fill_bulk_transfer(slot->xferPollIn, state->ctx->devHandle, BULK_READ_ENDPOINT,
+        &slot->status, 1, cbWritePollIn, slot, state->timeout);
+
+    slot->pending++;
+    state->inflight++;
+    if((ret = state->ctx->transport->submit(slot->xferPollIn)) < 0) {
+        slot->pending--;
+        state->inflight--;
+        fprintf(stderr, "Couldnt submit BULK IN transfer: '%s'\n", strerror(-ret));
+        state->error = -1;
+        return;
+    }
+
+    slot->pending++;
+    state->inflight++;
+    if((ret = state->ctx->transport->submit(slot->xferPollOut)) < 0) {
+        slot->pending--;
+        state->inflight--;
+        fprintf(stderr, "Couldnt submit BULK OUT transfer: '%s'\n", strerror(-ret));
+        state->error = -1;
+        return;
+    }
+    slot->polls++;
+}
+
+// --------------------------------------------------------------------------
+// ch341writeCheckSlot()
+//      compare the pages read back by a completed transfer with the image,
+//      queueing the ones that differ to be written again
+void ch341writeCheckSlot(struct ch341writeslot *slot) {
+    struct ch341writestate *state = slot->state;
+    struct ch341range *page;
+    uint32_t r, off = 0, idx;
+
+    for(r=0; r < slot->nreadback; r++) {
+        page = &slot->readback[r];
+        if(memcmp(slot->verifybuf + off, state->buffer + (state->wrap ? page->offset % state->wrap : page->offset), page->length)) {
+            idx = page->offset / state->eeprom_info->page_size;
+            if(++state->tries[idx] > WRITE_VERIFY_RETRIES) {
+                fprintf(stderr, "Page at [%04x] still differs after %d rewrites\n", page->offset, WRITE_VERIFY_RETRIES);
+                state->error = -1;
+                return;
             }
-            *outptr++ = mCH341A_CMD_I2C_STM_END;
-            part_no++;
+            fprintf(state->ctx->verbout, "Readback of page at [%04x] differs, writing it again\n", page->offset);
+            state->retry[state->nretry++] = *page;
+            state->rewrites++;
+        }
+        off += page->length;
+    }
+}
+
+// --------------------------------------------------------------------------
+// ch341writeSlotDone()
+//      called from the callbacks; once every transfer of a slot has completed its
+//      pages are written and checked, and the slot carries on with the next ones.
+//      flags the write as completed when nothing is left in flight or on error
+void ch341writeSlotDone(struct ch341writeslot *slot) {
+    struct ch341writestate *state = slot->state;
+    struct ch341range page;
+
+    if(!slot->pending && !state->error) {
+        ch341writeCheckSlot(slot);
+        if(state->verify && state->ackpoll && slot->written)
+            state->carry = slot->page;              // read back with the next transfer
+        state->byteswritten += slot->bytes;
+        slot->bytes = 0;
+        slot->written = FALSE;
+        slot->nreadback = 0;
+        if(!*state->ctx->cancel && !state->error && (state->carry.length || ch341writePeekPage(state, &page)))
+            ch341writeSubmitSlot(slot);
+    }
+    if(!state->inflight || state->error)
+        state->completed = 1;
+}
+
+// --------------------------------------------------------------------------
+// ch341writePages()
+//      write a list of address ranges, one page per i2c transaction
+//      the byte for address a comes from buffer[a % wrap], or buffer[a] if wrap is 0
+//      with ACK polling the next page is sent from the callback the moment the
+//      device acknowledges. otherwise each page carries its own on-chip wait and
+//      WRITE_QUEUE_DEPTH transfers are kept queued, so the CH341 never runs dry
+//      with ntargets the ranges address the interleaved images of ch341writeTargets()
+int32_t ch341writePages(struct ch341ctx *ctx, uint8_t *buffer, uint32_t wrap, struct ch341range *ranges, uint32_t nranges,
+                        struct EEPROM *eeprom_info, struct EEPROM *targets, uint32_t ntargets) {
+
+    struct ch341writestate state;
+    struct ch341writeslot *slots;
+    struct timeval tv = {1, 0};                     // upper bound on a wait, the callbacks wake us first
+    int32_t ret = 0, depth, i, j;
+    uint32_t end = 0;
+
+    memset(&state, 0, sizeof(state));
+    for(i=0; i < nranges; i++)
+        state.bytestowrite += ranges[i].length;
+    if(!state.bytestowrite)
+        return 0;
+
+    state.ctx         = ctx;
+    state.eeprom_info = eeprom_info;
+    state.buffer      = buffer;
+    state.wrap        = wrap;
+    state.ranges      = ranges;
+    state.nranges     = nranges;
+    state.nextaddr    = ranges[0].offset;
+    state.targets     = targets;
+    state.ntargets    = ntargets;
+    state.ackpoll     = ctx->tuning.writeackpoll && (ntargets || ctx->tuning.writebatch <= 1);  // batched pages wait on the CH341
+    state.batch       = ntargets ? (state.ackpoll ? ntargets : MAX(ctx->tuning.writebatch, ntargets)) : ctx->tuning.writebatch;   // a round per transfer
+    state.verify      = ctx->tuning.writeverify && !ntargets;
+
+    depth = state.ackpoll ? 1 : WRITE_QUEUE_DEPTH;  // a poll has to succeed before the next page goes out
+    state.timeout = DEFAULT_TIMEOUT * state.batch * depth;
+
+    for(i=0; i < nranges; i++)
+        end = MAX(end, ranges[i].offset + ranges[i].length);
+    state.tries = (uint8_t *) calloc(end / eeprom_info->page_size + 1, 1);
+    if(!state.tries || !(slots = (struct ch341writeslot *) calloc(depth, sizeof(struct ch341writeslot)))) {
+        fprintf(stderr, "Couldnt allocate USB transfer structures\n");
+        free(state.tries);
+        return -1;
+    }
+
+    for(i=0; i < depth; i++) {
+        slots[i].state = &state;
+        if(!(slots[i].xferBulkOut = ctx->transport->alloc()) ||
+           !(slots[i].xferPollOut = ctx->transport->alloc()) ||
+           !(slots[i].xferPollIn = ctx->transport->alloc()))
+            state.error = -1;
+        for(j=0; j < WRITE_VERIFY_PKTS; j++)
+            if(!(slots[i].xferVerifyIn[j] = ctx->transport->alloc()))
+                state.error = -1;
+    }
+
+    if(state.error) {
+        fprintf(stderr, "Couldnt allocate USB transfer structures\n");
+        goto out;
+    }
+
+    fprintf(ctx->verbout, "Writing [%d] bytes in [%d] address ranges\n", state.bytestowrite, nranges);
+
+    ch341progressStart(&state.progress, ctx, "Written", "write", state.bytestowrite);
+
+    for(i=0; i < depth && !state.error; i++)
+        ch341writeSubmitSlot(&slots[i]);
+
+    while(!state.completed && !state.error) {       // sleep until a callback reports completion
+        ch341progressUpdate(&state.progress, state.byteswritten);
+        ret = ctx->transport->events(ctx, &tv, &state.completed);
+
+        if(*ctx->cancel) {
+            fprintf(stderr, "Write interrupted at [%d] of [%d] bytes\n", state.byteswritten, state.bytestowrite);
+            state.error = -1;
+        } else if(ret < 0 && ret != LIBUSB_ERROR_INTERRUPTED) {
+            fprintf(stderr, "ret from libusb_handle_timeout = %d\n", ret);
+            fprintf(stderr, "USB write error : %s\n", strerror(-ret));
+            state.error = -1;
         }
-        uint32_t payload_size = outptr - ch341outBuffer;
+    }
 
-        for(i=0; i < payload_size; i++) {
-            if(!(i%0x10))
-                fprintf(debugout, "\n%04x : ", i);
-            fprintf(debugout, "%02x ", ch341outBuffer[i]);
+    if(state.error) {                               // nothing may be left in flight when the transfers are freed
+        for(i=0; i < depth; i++) {
+            ch341cancelTransfer(ctx, slots[i].xferBulkOut);
+            ch341cancelTransfer(ctx, slots[i].xferPollOut);
+            ch341cancelTransfer(ctx, slots[i].xferPollIn);
+            for(j=0; j < WRITE_VERIFY_PKTS; j++)
+                ch341cancelTransfer(ctx, slots[i].xferVerifyIn[j]);
         }
-        fprintf(debugout, "\n");
+        while(state.inflight > 0)
+            if(ctx->transport->events(ctx, &tv, NULL) < 0)
+                break;
+        ch341drainBulkIn(ctx);
+    } else {
+        ch341progressEnd(&state.progress, state.byteswritten);
+        if(state.verify)
+            fprintf(ctx->verbout, "Read back every page, [%d] written again after a mismatch\n", state.rewrites);
+    }
 
-        ret = libusb_bulk_transfer(devHandle, BULK_WRITE_ENDPOINT,
-            ch341outBuffer, payload_size, &actuallen, DEFAULT_TIMEOUT);
+out:
+    for(i=0; i < depth; i++) {
+        ctx->transport->free(slots[i].xferBulkOut);
+        ctx->transport->free(slots[i].xferPollOut);
+        ctx->transport->free(slots[i].xferPollIn);
+        for(j=0; j < WRITE_VERIFY_PKTS; j++)
+            ctx->transport->free(slots[i].xferVerifyIn[j]);
+    }
+    free(slots);
+    free(state.tries);
+    return state.error;
+}
 
-        if(ret < 0) {
-            fprintf(stderr, "Failed to write to EEPROM: '%s'\n", strerror(-ret));
-            return -1;
+// --------------------------------------------------------------------------
+// ch341diffPages()
+//      compare two images page by page, filling ranges with the runs of pages
+//      that differ. ranges needs room for bytes/page_size + 1 entries
+//      returns the number of ranges
+uint32_t ch341diffPages(uint8_t *chip, uint8_t *image, uint32_t bytes, uint16_t page_size, struct ch341range *ranges) {
+    uint32_t offset, len, nranges = 0;
+
+    for(offset = 0; offset < bytes; offset += len) {
+        len = MIN(page_size, bytes - offset);
+        if(!memcmp(chip + offset, image + offset, len))
+            continue;
+        if(nranges && ranges[nranges-1].offset + ranges[nranges-1].length == offset)
+            ranges[nranges-1].length += len;        // extend the run of dirty pages
+        else {
+            ranges[nranges].offset = offset;
+            ranges[nranges].length = len;
+            nranges++;
         }
+    }
+    return nranges;
+}
 
-        fprintf(debugout, "Writing [aa 5a 00] to EEPROM\n");   // Magic CH341a packet! Undocumented, unknown purpose
 
-        outptr    = ch341outBuffer;
-        *outptr++ = mCH341A_CMD_I2C_STREAM;
-        *outptr++ = mCH341A_CMD_I2C_STM_MS | 10; // Wait 10ms (?)
-        *outptr++ = mCH341A_CMD_I2C_STM_END;
+// --------------------------------------------------------------------------
+// ch341patchEEPROM()
+//      write the bytes of image (indexed by EEPROM address) covered by ranges,
+//      merged into the current contents of the pages they touch. only those
+//      pages are read, and only the ones that end up different are written
+//      returns the number of pages written, -1 on error
+int32_t ch341patchEEPROM(struct ch341ctx *ctx, uint8_t *image, struct ch341range *ranges, uint32_t nranges, struct EEPROM *eeprom_info) {
+    uint16_t page_size = (*eeprom_info).page_size;
+    uint32_t npages = (*eeprom_info).size / page_size;
+    uint32_t i, ntouched, ndirty, touchedbytes = 0, dirtybytes = 0;
+    struct ch341range *touched, *dirty;
+    uint8_t *chip, *merged;
+    int32_t ret = -1;
+
+    touched = (struct ch341range *) malloc(nranges * sizeof(struct ch341range));
+    dirty = (struct ch341range *) malloc((npages + 1) * sizeof(struct ch341range));
+    chip = (uint8_t *) malloc((*eeprom_info).size);
+    merged = (uint8_t *) malloc((*eeprom_info).size);
+    if(!touched || !dirty || !chip || !merged) {
+        fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
+        goto out;
+    }
+                                                    // widen each range to whole pages
+    for(i = 0; i < nranges; i++) {
+        touched[i].offset = ranges[i].offset / page_size * page_size;
+        touched[i].length = (ranges[i].offset + ranges[i].length + page_size - 1) / page_size * page_size - touched[i].offset;
+    }
+    ntouched = ch341readCoalesce(touched, nranges, 0);
+    for(i = 0; i < ntouched; i++)
+        touchedbytes += touched[i].length;
+
+    memset(chip, 0xff, (*eeprom_info).size);
+    if(ch341readRanges(ctx, chip, touched, ntouched, eeprom_info, NULL, NULL) < 0)
+        goto out;
+
+    memcpy(merged, chip, (*eeprom_info).size);
+    for(i = 0; i < nranges; i++)
+        memcpy(merged + ranges[i].offset, image + ranges[i].offset, ranges[i].length);
+
+    ndirty = ch341diffPages(chip, merged, (*eeprom_info).size, page_size, dirty);
+    for(i = 0; i < ndirty; i++)
+        dirtybytes += dirty[i].length;
+    fprintf(ctx->verbout, "Read [%d] touched pages, [%d] of them changed\n", touchedbytes / page_size, dirtybytes / page_size);
+
+    if(ch341writeRanges(ctx, merged, dirty, ndirty, eeprom_info) < 0)
+        goto out;
+    ret = dirtybytes / page_size;
+
+out:
+    free(touched);
+    free(dirty);
+    free(chip);
+    free(merged);
+    return ret;
+}
 
-        ret = libusb_bulk_transfer(devHandle, BULK_WRITE_ENDPOINT, ch341outBuffer, 3, &actuallen, DEFAULT_TIMEOUT);
+// --------------------------------------------------------------------------
+// cbFillScan()
+//      block callback of the blank scan, flags the pages not matching the fill template
+int32_t cbFillScan(uint32_t offset, uint8_t *data, uint32_t len, void *arg) {
+    struct ch341fillscan *scan = (struct ch341fillscan *) arg;
+    uint32_t i;
+
+    for(i = 0; i < len; i++)
+        if(data[i] != scan->page[(offset + i) % scan->page_size])
+            scan->dirty[(offset + i) / scan->page_size] = TRUE;
+    return 0;
+}
 
-        if(ret < 0) {
-            fprintf(stderr, "Failed to write to EEPROM: '%s'\n", strerror(-ret));
+// --------------------------------------------------------------------------
+// ch341fillEEPROM()
+//      fill n bytes from the start of the device with a repeating pattern whose
+//      length divides the page size. the device is scanned first, a block at a
+//      time without staging it, and only the pages not already holding the
+//      pattern are written, all from one page template
+//      returns the number of pages written, -1 on error
+int32_t ch341fillEEPROM(struct ch341ctx *ctx, uint8_t *pattern, uint32_t patlen, uint32_t bytes, struct EEPROM *eeprom_info) {
+    uint8_t page[EEPROM_MAX_PAGE_SZ];
+    uint16_t page_size = (*eeprom_info).page_size;
+    uint32_t npages = (bytes + page_size - 1) / page_size;
+    uint32_t i, nranges = 0, written = 0;
+    struct ch341range range = {0, bytes}, *ranges;
+    struct ch341fillscan scan;
+    int32_t ret = -1;
+
+    if(!patlen || page_size % patlen) {
+        fprintf(stderr, "Fill pattern of [%d] bytes doesnt evenly divide the [%d] byte page\n", patlen, page_size);
+        return -1;
+    }
+    for(i = 0; i < page_size; i++)
+        page[i] = pattern[i % patlen];
+
+    scan.dirty = (uint8_t *) calloc(npages, 1);
+    ranges = (struct ch341range *) malloc(npages * sizeof(struct ch341range));
+    if(!scan.dirty || !ranges) {
+        fprintf(stderr, "Couldnt malloc space needed for blank scan\n");
+        goto out;
+    }
+    scan.page = page;
+    scan.page_size = page_size;
+
+    if(ch341readRanges(ctx, NULL, &range, 1, eeprom_info, cbFillScan, &scan) < 0)
+        goto out;
+
+    for(i = 0; i < npages; i++) {
+        if(!scan.dirty[i])
+            continue;
+        if(nranges && ranges[nranges-1].offset + ranges[nranges-1].length == i * page_size)
+            ranges[nranges-1].length += MIN(page_size, bytes - i * page_size);
+        else {
+            ranges[nranges].offset = i * page_size;
+            ranges[nranges].length = MIN(page_size, bytes - i * page_size);
+            nranges++;
+        }
+        written++;
+    }
+    fprintf(ctx->verbout, "Blank scan found [%d] of [%d] pages to write\n", written, npages);
+
+    if(ch341writePages(ctx, page, page_size, ranges, nranges, eeprom_info, NULL, 0) < 0)
+        goto out;
+    ret = written;
+
+out:
+    free(scan.dirty);
+    free(ranges);
+    return ret;
+}
+
+// --------------------------------------------------------------------------
+// cbBlankCheck()
+//      block callback of a blank check, scans a word at a time for anything but
+//      0xff and stops the read at the first block that has some, recording the
+//      address of its first programmed byte in arg
+int32_t cbBlankCheck(uint32_t offset, uint8_t *data, uint32_t len, void *arg) {
+    uint64_t word;
+    uint32_t i = 0;
+
+    for(; i + sizeof(word) <= len; i += sizeof(word)) {
+        memcpy(&word, data + i, sizeof(word));     // blocks arent aligned, let the compiler pick the load
+        if(word != UINT64_MAX)
+            break;
+    }
+    for(; i < len; i++)
+        if(data[i] != 0xff) {
+            *(uint32_t *) arg = offset + i;
             return -1;
         }
+    return 0;
+}
 
-        /*
-        struct timeval tv = {0, 100};                   // our async polling interval
-		ret = libusb_handle_events_timeout(NULL, &tv);
-		if (ret < 0) {          // indicates an error
-            fprintf(stderr, "ret from libusb_handle_timeout = %d\n", ret);
-            fprintf(stderr, "USB read error : %s\n", strerror(-ret));
+// --------------------------------------------------------------------------
+// ch341blankCheck()
+//      check whether the first n bytes of the device are all 0xff, reading them
+//      into buffer only until the first programmed byte.
+//      returns its address, n if the device is blank, -1 on error
+int32_t ch341blankCheck(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytes, struct EEPROM *eeprom_info) {
+    struct ch341range range = {0, bytes};
+    uint32_t first = bytes;
+
+    if(ch341readRanges(ctx, buffer, &range, 1, eeprom_info, cbBlankCheck, &first) < 0 && first == bytes)
+        return -1;
+    return first;
+}
+
+// --------------------------------------------------------------------------
+// cbVerify()
+//      block callback of a verify, compares each block with the image as it
+//      arrives. aborts the read on the first mismatch unless a full report is
+//      wanted, in which case the mismatching addresses are collected as ranges
+int32_t cbVerify(uint32_t offset, uint8_t *data, uint32_t len, void *arg) {
+    struct ch341verify *verify = (struct ch341verify *) arg;
+    struct ch341range *range;
+    uint32_t i, addr;
+
+    for(i = 0; i < len; i++) {
+        addr = offset + i;
+        if(data[i] == verify->image[addr])
+            continue;
+        if(!verify->mismatches++)
+            verify->first = addr;
+        if(!verify->fullreport)
             return -1;
+
+        range = verify->nranges ? &verify->ranges[verify->nranges - 1] : NULL;
+        if(range && range->offset + range->length == addr) {
+            range->length++;
+            continue;
         }
-        */
-        fprintf(stdout, "Written %d%% [%d] of [%d] bytes      \r", 100*(bytesum-bytes)/bytesum, bytesum-bytes, bytesum);
+        if(verify->nranges == verify->maxranges) {
+            verify->maxranges = verify->maxranges ? verify->maxranges * 2 : 16;
+            if(!(range = realloc(verify->ranges, verify->maxranges * sizeof(struct ch341range)))) {
+                fprintf(stderr, "Couldnt allocate memory for the mismatch list\n");
+                return -1;
+            }
+            verify->ranges = range;
+        }
+        verify->ranges[verify->nranges].offset = addr;
+        verify->ranges[verify->nranges].length = 1;
+        verify->nranges++;
     }
     return 0;
 }
 
+// --------------------------------------------------------------------------
+// ch341verifyEEPROM()
+//      compare n bytes from the start of the device with image while reading
+//      them into buffer. verify->image and verify->fullreport are set by the
+//      caller, the rest is filled in; verify->ranges is to be freed by the caller
+//      returns the number of mismatching bytes, -1 on error
+int32_t ch341verifyEEPROM(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytes, struct ch341verify *verify, struct EEPROM *eeprom_info) {
+    struct ch341range range = {0, bytes};
+
+    verify->mismatches = 0;
+    verify->nranges = 0;
+    if(ch341readRanges(ctx, buffer, &range, 1, eeprom_info, cbVerify, verify) < 0
+       && (verify->fullreport || !verify->mismatches))
+        return -1;
+    return verify->mismatches;
+}
+
+// --------------------------------------------------------------------------
+// ch341i2cAddress()
+//      8-bit i2c write address of the device holding EEPROM address addr
+uint8_t ch341i2cAddress(struct EEPROM *eeprom_info, uint32_t addr) {
+    if(eeprom_info->addr_size >= 2)
+        return (uint8_t) (0xa0 | (((addr >> 16) & 1) | eeprom_info->addr)<<1);
+    return (uint8_t) (0xa0 | (((addr >> 8) & 7) | eeprom_info->addr)<<1);
+}
+
+// --------------------------------------------------------------------------
+// ch341PollCmdMarshall()
+//      build the stream frame addressing the device holding addr, the CH341
+//      returns one BULK IN byte whose bit 7 is clear if the device acknowledged
+size_t ch341PollCmdMarshall(uint8_t *buffer, uint32_t addr, struct EEPROM *eeprom_info) {
+    buffer[0] = mCH341A_CMD_I2C_STREAM;
+    buffer[1] = mCH341A_CMD_I2C_STM_STA;
+    buffer[2] = mCH341A_CMD_I2C_STM_OUT;                // OUT with no length returns the ACK status
+    buffer[3] = ch341i2cAddress(eeprom_info, addr);
+    buffer[4] = mCH341A_CMD_I2C_STM_STO;
+    buffer[5] = mCH341A_CMD_I2C_STM_END;
+    return 6;
+}
+
+// --------------------------------------------------------------------------
+// ch341ackPoll()
+//      address the device until it acknowledges, i.e. its internal write cycle
+//      has finished. returns the number of polls, or -1 on timeout or error
+int32_t ch341ackPoll(struct ch341ctx *ctx, struct EEPROM *eeprom_info, uint32_t addr) {
+    uint8_t ch341outBuffer[6], status;
+    int32_t ret, actuallen = 0, polls = 0;
+    double deadline = ch341progressNow() + ACK_POLL_TIMEOUT / 1000.0;
+
+    do {
+        polls++;
+        ret = ctx->transport->bulk(ctx, BULK_WRITE_ENDPOINT, ch341outBuffer,
+                                   ch341PollCmdMarshall(ch341outBuffer, addr, eeprom_info), &actuallen, DEFAULT_TIMEOUT);
+        if(ret < 0) {
+            fprintf(stderr, "Failed to poll EEPROM: '%s'\n", strerror(-ret));
+            return -1;
+        }
+        ret = ctx->transport->bulk(ctx, BULK_READ_ENDPOINT, &status, 1, &actuallen, DEFAULT_TIMEOUT);
+        if(ret < 0 || actuallen != 1) {
+            fprintf(stderr, "Failed to read ACK status from EEPROM: '%s'\n", strerror(-ret));
+            return -1;
+        }
+        if(!(status & 0x80))                            // bit 7 clear: device acknowledged
+            return polls;
+    } while(ch341progressNow() < deadline);
+
+    fprintf(stderr, "EEPROM did not acknowledge within %dms after writing address [%04x]\n", ACK_POLL_TIMEOUT, addr);
+    return -1;
+}
+
+// --------------------------------------------------------------------------
+// ch341DelayCmdMarshall()
+//      build a stream frame making the CH341 wait ms (up to MAX_WRITE_CYCLE_DELAY)
+//      milliseconds, in steps of at most 15ms
+size_t ch341DelayCmdMarshall(uint8_t *buffer, uint32_t ms) {
+    uint8_t *ptr = buffer;
+    uint32_t step;
+
+    *ptr++ = mCH341A_CMD_I2C_STREAM;
+    for(; ms; ms -= step) {
+        step = MIN(ms, mCH341A_CMD_I2C_STM_DLY);
+        *ptr++ = mCH341A_CMD_I2C_STM_MS | step;
+    }
+    *ptr++ = mCH341A_CMD_I2C_STM_END;
+    return ptr - buffer;
+}
 
 // --------------------------------------------------------------------------
 // parseEEPsize()
@@ -448,3 +1461,76 @@ int32_t parseEEPsize(char* eepromname, struct EEPROM *eeprom) {
         }
     return -1;
 }
+
+// --------------------------------------------------------------------------
+// parseFill()
+//   passed a fill pattern as hex bytes (e.g. ff, 0x00, 55aa), stores up to
+//   maxlen bytes in pattern, returns the pattern length or -1 if malformed
+int32_t parseFill(char *arg, uint8_t *pattern, uint32_t maxlen) {
+    uint32_t digits, len = 0, i, n;
+    char byte[3];
+
+    if(!strncmp(arg, "0x", 2) || !strncmp(arg, "0X", 2))
+        arg += 2;
+    digits = strlen(arg);
+    if(!digits || (digits + 1) / 2 > maxlen || strspn(arg, "0123456789abcdefABCDEF") != digits)
+        return -1;
+    for(i = 0; i < digits; i += n) {
+        n = (!i && (digits & 1)) ? 1 : 2;           // odd digit count, the first byte is one digit
+        memcpy(byte, arg + i, n);
+        byte[n] = 0;
+        pattern[len++] = (uint8_t) strtoul(byte, NULL, 16);
+    }
+    return len;
+}
+
+// --------------------------------------------------------------------------
+// parsePatch()
+//   passed "offset:hexbytes" (e.g. 0x1fa:0011223344ff), fills in the range
+//   and up to maxlen bytes of data, returns -1 if malformed
+int32_t parsePatch(char *arg, struct ch341range *range, uint8_t *data, uint32_t maxlen) {
+    char *end;
+    int32_t len;
+
+    range->offset = strtoul(arg, &end, 0);
+    if(end == arg || *end != ':')
+        return -1;
+    if((len = parseFill(end + 1, data, maxlen)) < 0)
+        return -1;
+    range->length = len;
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// parseRange()
+//   passed "offset:length[:filename]" (C notation, e.g. 0x1fa:6:mac.bin),
+//   fills in the range and filename (NULL if absent), returns -1 if malformed
+int32_t parseRange(char *arg, struct ch341range *range, char **filename) {
+    char *end;
+
+    range->offset = strtoul(arg, &end, 0);
+    if(end == arg || *end != ':')
+        return -1;
+    arg = end + 1;
+    range->length = strtoul(arg, &end, 0);
+    if(end == arg || !range->length || (*end && *end != ':'))
+        return -1;
+    *filename = (*end && *(end+1)) ? end + 1 : NULL;
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// parseTarget()
+//   passed "chipselect:filename" (e.g. 3:board3.bin), fills in the chip
+//   select and filename, returns -1 if malformed or the chip select is over 7
+int32_t parseTarget(char *arg, uint8_t *cs, char **filename) {
+    char *end;
+    unsigned long value;
+
+    value = strtoul(arg, &end, 0);
+    if(end == arg || *end != ':' || !*(end+1) || value > 7)
+        return -1;
+    *cs = (uint8_t) value;
+    *filename = end + 1;
+    return 0;
+}
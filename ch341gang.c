@@ -0,0 +1,132 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+extern FILE *debugout, *verbout, *msgout;
+
+// --------------------------------------------------------------------------
+// ch341resultName()
+//      the result column of the tables of gang mode and --jobs for an exit status
+char *ch341resultName(int32_t status) {
+    switch(status) {
+        case EXIT_OK:        return "passed";
+        case EXIT_NOT_BLANK: return "not blank";
+        case EXIT_MISMATCH:  return "mismatch";
+        default:             return "failed";
+    }
+}
+
+// --------------------------------------------------------------------------
+// ch341gangWorker()
+//      thread of one gang adapter: set its bus speed and run its copy of the job.
+//      each adapter is on a libusb context of its own, or an emulated one, so
+//      the callbacks of its transfers only run on this thread
+void *ch341gangWorker(void *arg) {
+    struct ch341gangworker *worker = (struct ch341gangworker *) arg;
+    double start = ch341progressNow();
+
+    if(ch341setstream(worker->ctx, worker->speed) < 0) {
+        fprintf(stderr, "Couldnt set i2c bus speed of the adapter on bus [%d] device [%d]\n", worker->bus, worker->address);
+        worker->status = EXIT_ERROR;
+    } else
+        worker->status = ch341runJob(&worker->job, worker->ctx, worker->readbuf);
+    worker->seconds = ch341progressNow() - start;
+    return NULL;
+}
+
+// --------------------------------------------------------------------------
+// ch341gangRun()
+//      open every CH341 and run the job on all of them at once, one thread per
+//      adapter, then print a pass/fail and timing table.
+//      each worker gets a context of its own from ch341configureAll(); ctx only
+//      finds the adapters.
+//      returns EXIT_OK if all passed, else the status of the first that didnt
+int32_t ch341gangRun(struct ch341job *job, struct ch341ctx *ctx, uint32_t speed) {
+    struct ch341ctx *adapters[MAX_GANG_ADAPTERS];
+    struct ch341gangworker *workers = NULL;
+    int32_t n, i, passed = 0, status = EXIT_OK;
+    double start;
+
+    if((n = ch341configureAll(ctx, USB_LOCK_VENDOR, USB_LOCK_PRODUCT, adapters, MAX_GANG_ADAPTERS)) <= 0) {
+        if(!n)
+            fprintf(stderr, "Couldnt find any USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+        return EXIT_ERROR;
+    }
+    fprintf(msgout, "Running on [%d] adapters\n", n);
+
+    if(!(workers = (struct ch341gangworker *) calloc(n, sizeof(struct ch341gangworker)))) {
+        fprintf(stderr, "Couldnt allocate memory for [%d] adapters\n", n);
+        status = EXIT_ERROR;
+        goto out;
+    }
+
+    start = ch341progressNow();
+
+    for(i=0; i < n; i++) {
+        workers[i].ctx       = adapters[i];
+        ch341ctxLocation(adapters[i], &workers[i].bus, &workers[i].address);
+        workers[i].speed     = speed;
+        workers[i].job       = *job;
+        workers[i].job.tuning.progressmode = PROGRESS_OFF;  // progress lines of several adapters would only garble
+        workers[i].status    = EXIT_ERROR;
+        if(!(workers[i].readbuf = (uint8_t *) malloc(MAX_EEPROM_SIZE))) {
+            fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
+            continue;
+        }
+        if(pthread_create(&workers[i].thread, NULL, ch341gangWorker, &workers[i])) {
+            fprintf(stderr, "Couldnt start the thread of the adapter on bus [%d] device [%d]\n", workers[i].bus, workers[i].address);
+            free(workers[i].readbuf);
+            workers[i].readbuf = NULL;
+        }
+    }
+
+    for(i=0; i < n; i++)
+        if(workers[i].readbuf) {
+            pthread_join(workers[i].thread, NULL);
+            free(workers[i].readbuf);
+        }
+
+    fprintf(msgout, "\nAdapter  Bus  Device  Result     Time\n");
+    for(i=0; i < n; i++) {
+        fprintf(msgout, "%7d  %3d  %6d  %-9s  %6.2fs\n", i, workers[i].bus, workers[i].address, ch341resultName(workers[i].status), workers[i].seconds);
+        if(workers[i].status == EXIT_OK)
+            passed++;
+        else if(status == EXIT_OK)
+            status = workers[i].status;
+    }
+    fprintf(msgout, "[%d] of [%d] adapters passed in [%.2fs]\n", passed, n, ch341progressNow() - start);
+
+out:
+    for(i=0; i < n; i++)
+        ch341ctxFree(adapters[i]);                  // releases and closes its adapter
+    free(workers);
+    fprintf(verbout, "Closed [%d] USB devices\n", n);
+    return status;
+}
@@ -0,0 +1,168 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+static const uint32_t sha256k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static uint32_t crc32table[256];
+static pthread_once_t crc32once = PTHREAD_ONCE_INIT;   // contexts on several threads may start a crc32 at once
+
+#define ROR32(x, n)     (((x) >> (n)) | ((x) << (32 - (n))))
+
+// --------------------------------------------------------------------------
+// ch341hashParseType()
+//      map a checksum name from the command line to its HASH_ type, -1 if unknown
+int32_t ch341hashParseType(char *name) {
+    if(!strcmp(name, "crc32"))
+        return HASH_CRC32;
+    if(!strcmp(name, "sha256"))
+        return HASH_SHA256;
+    return -1;
+}
+
+// --------------------------------------------------------------------------
+// ch341hashName()
+//      printable name of a HASH_ type
+char *ch341hashName(uint8_t type) {
+    return type == HASH_SHA256 ? "sha256" : "crc32";
+}
+
+// --------------------------------------------------------------------------
+// ch341hashCrcTable()
+//      fill in the table of the reflected IEEE 802.3 polynomial, as zlib
+void ch341hashCrcTable(void) {
+    uint32_t i, j, c;
+
+    for(i = 0; i < 256; i++) {
+        for(c = i, j = 0; j < 8; j++)
+            c = (c & 1) ? 0xedb88320 ^ (c >> 1) : c >> 1;
+        crc32table[i] = c;
+    }
+}
+
+// --------------------------------------------------------------------------
+// ch341hashInit()
+//      start a new checksum of the given type
+void ch341hashInit(struct ch341hash *hash, uint8_t type) {
+    static const uint32_t sha256h[8] = {
+        0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19
+    };
+
+    memset(hash, 0, sizeof(struct ch341hash));
+    hash->type = type;
+    hash->crc = 0xffffffff;
+    memcpy(hash->h, sha256h, sizeof(sha256h));
+
+    if(type == HASH_CRC32)
+        pthread_once(&crc32once, ch341hashCrcTable);
+}
+
+// --------------------------------------------------------------------------
+// ch341hashBlock()
+//      run the SHA-256 compression function over the 64 byte block in hash->block
+void ch341hashBlock(struct ch341hash *hash) {
+    uint32_t w[64], a, b, c, d, e, f, g, h, t1, t2;
+    int i;
+
+    for(i = 0; i < 16; i++)
+        w[i] = (uint32_t) hash->block[i*4] << 24 | hash->block[i*4+1] << 16 | hash->block[i*4+2] << 8 | hash->block[i*4+3];
+    for(; i < 64; i++)
+        w[i] = w[i-16] + (ROR32(w[i-15], 7) ^ ROR32(w[i-15], 18) ^ (w[i-15] >> 3))
+             + w[i-7] + (ROR32(w[i-2], 17) ^ ROR32(w[i-2], 19) ^ (w[i-2] >> 10));
+
+    a = hash->h[0]; b = hash->h[1]; c = hash->h[2]; d = hash->h[3];
+    e = hash->h[4]; f = hash->h[5]; g = hash->h[6]; h = hash->h[7];
+    for(i = 0; i < 64; i++) {
+        t1 = h + (ROR32(e, 6) ^ ROR32(e, 11) ^ ROR32(e, 25)) + ((e & f) ^ (~e & g)) + sha256k[i] + w[i];
+        t2 = (ROR32(a, 2) ^ ROR32(a, 13) ^ ROR32(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g; g = f; f = e; e = d + t1;
+        d = c; c = b; b = a; a = t1 + t2;
+    }
+    hash->h[0] += a; hash->h[1] += b; hash->h[2] += c; hash->h[3] += d;
+    hash->h[4] += e; hash->h[5] += f; hash->h[6] += g; hash->h[7] += h;
+}
+
+// --------------------------------------------------------------------------
+// ch341hashUpdate()
+//      add the next len bytes to the checksum
+void ch341hashUpdate(struct ch341hash *hash, uint8_t *data, uint32_t len) {
+    uint32_t i;
+
+    hash->bytes += len;
+    if(hash->type == HASH_CRC32) {
+        for(i = 0; i < len; i++)
+            hash->crc = crc32table[(hash->crc ^ data[i]) & 0xff] ^ (hash->crc >> 8);
+        return;
+    }
+    for(i = 0; i < len; i++) {
+        hash->block[hash->fill++] = data[i];
+        if(hash->fill == sizeof(hash->block)) {
+            ch341hashBlock(hash);
+            hash->fill = 0;
+        }
+    }
+}
+
+// --------------------------------------------------------------------------
+// ch341hashFinal()
+//      finish the checksum and write it to hex as lowercase hex digits,
+//      hex has room for HASH_MAX_HEX characters
+void ch341hashFinal(struct ch341hash *hash, char *hex) {
+    uint64_t bits = hash->bytes * 8;
+    int i;
+
+    if(hash->type == HASH_CRC32) {
+        sprintf(hex, "%08x", hash->crc ^ 0xffffffff);
+        return;
+    }
+                                                    // pad with 0x80, zeros and the length in bits
+    hash->block[hash->fill++] = 0x80;
+    if(hash->fill > 56) {
+        memset(hash->block + hash->fill, 0, 64 - hash->fill);
+        ch341hashBlock(hash);
+        hash->fill = 0;
+    }
+    memset(hash->block + hash->fill, 0, 56 - hash->fill);
+    for(i = 0; i < 8; i++)
+        hash->block[56 + i] = bits >> (56 - i*8);
+    ch341hashBlock(hash);
+
+    for(i = 0; i < 8; i++)
+        sprintf(hex + i*8, "%08x", hash->h[i]);
+}
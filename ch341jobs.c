@@ -0,0 +1,295 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <ctype.h>
+#include <getopt.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+extern FILE *debugout, *verbout, *msgout;
+
+// --------------------------------------------------------------------------
+// ch341jobsOpName()
+//      the operation column of the --jobs table
+char *ch341jobsOpName(char operation) {
+    switch(operation) {
+        case 'r': return "read";
+        case 'w': return "write";
+        case 't': return "targets";
+        case 'V': return "verify";
+        case 'e': return "erase";
+        case 'F': return "fill";
+        case 'x': return "patch";
+        case 'b': return "blank";
+        default:  return "?";
+    }
+}
+
+// --------------------------------------------------------------------------
+// ch341jobsLoad()
+//      parse the manifest named by defaults->manifest into the queue. each
+//      line holds the options of one job as they would be given on the command
+//      line; blank lines and everything after a # are skipped. the tuning, bus
+//      speed and delay cache of defaults apply unless a line sets its own
+//      returns the number of jobs, -1 on errors
+int32_t ch341jobsLoad(struct ch341job *defaults, struct ch341jobqueue *queue) {
+    char buf[MANIFEST_MAX_LINE + 2], *argv[SERVE_MAX_ARGS + 1], *p;
+    FILE *fp, *savemsg = msgout, *savedebug = debugout, *saveverb = verbout;
+    struct ch341manifestjob *entry, *grown;
+    uint32_t lineno = 0, maxjobs = 0;
+    int argc, ret;
+
+    memset(queue, 0, sizeof(struct ch341jobqueue));
+    if(!(fp = fopen(defaults->manifest, "r"))) {
+        fprintf(stderr, "Couldnt open manifest [%s]\n", defaults->manifest);
+        return -1;
+    }
+
+    while(fgets(buf, sizeof(buf), fp)) {
+        lineno++;
+        if(strlen(buf) > MANIFEST_MAX_LINE) {
+            fprintf(stderr, "Line [%d] of manifest [%s] is too long\n", lineno, defaults->manifest);
+            goto fail;
+        }
+        if((p = strchr(buf, '#')))
+            *p = 0;
+        for(p = buf; isspace((unsigned char) *p); p++)
+            ;
+        if(!*p)
+            continue;
+
+        if(queue->njobs == maxjobs) {
+            maxjobs = maxjobs ? maxjobs * 2 : 16;
+            if(!(grown = (struct ch341manifestjob *) realloc(queue->jobs, maxjobs * sizeof(struct ch341manifestjob)))) {
+                fprintf(stderr, "Couldnt allocate memory for [%d] jobs\n", maxjobs);
+                goto fail;
+            }
+            queue->jobs = grown;
+        }
+        entry = &queue->jobs[queue->njobs];
+        memset(entry, 0, sizeof(struct ch341manifestjob));
+        if(!(entry->line = strdup(p))) {
+            fprintf(stderr, "Couldnt allocate memory for line [%d] of manifest [%s]\n", lineno, defaults->manifest);
+            goto fail;
+        }
+        queue->njobs++;                             // freed with the queue from here on
+        entry->lineno  = lineno;
+        entry->adapter = -1;
+        entry->status  = EXIT_ERROR;
+
+        argv[0] = "ch341eeprom";                    // split into arguments as a shell would, without quoting
+        for(argc = 1, p = strtok(entry->line, " \t\r\n"); p; p = strtok(NULL, " \t\r\n")) {
+            if(argc == SERVE_MAX_ARGS) {
+                fprintf(stderr, "Line [%d] of manifest [%s] has too many arguments\n", lineno, defaults->manifest);
+                goto fail;
+            }
+            argv[argc++] = p;
+        }
+        argv[argc] = NULL;
+
+        ch341jobInit(&entry->job);
+        entry->job.tuning   = defaults->tuning;
+        entry->job.speed    = defaults->speed;
+        entry->job.twrcache = defaults->twrcache;
+        #if defined(__APPLE__) || defined(__FreeBSD__)
+            optreset = 1;
+            optind = 1;
+        #else
+            optind = 0;                             // getopt starts over on the next argv
+        #endif
+        ret = ch341parseJob(argc, argv, &entry->job);
+        msgout   = savemsg;                         // the streams stay as the command line set them
+        debugout = savedebug;
+        verbout  = saveverb;
+        if(ret != 0) {
+            fprintf(stderr, "Invalid job on line [%d] of manifest [%s]\n", lineno, defaults->manifest);
+            goto fail;
+        }
+        if(entry->job.manifest || entry->job.serve || entry->job.client || entry->job.gang || entry->job.emulate) {
+            fprintf(stderr, "Job on line [%d] of manifest [%s] cant serve, gang, emulate or run other manifests\n", lineno, defaults->manifest);
+            goto fail;
+        }
+        if(entry->job.calibrate || entry->job.tostdout) {
+            fprintf(stderr, "Job on line [%d] of manifest [%s] cant calibrate or stream to stdout\n", lineno, defaults->manifest);
+            goto fail;
+        }
+    }
+    fclose(fp);
+
+    if(!queue->njobs) {
+        fprintf(stderr, "No jobs in manifest [%s]\n", defaults->manifest);
+        return -1;
+    }
+    pthread_mutex_init(&queue->lock, NULL);
+    return queue->njobs;
+
+fail:
+    fclose(fp);
+    ch341jobsFree(queue);
+    return -1;
+}
+
+// --------------------------------------------------------------------------
+// ch341jobsFree()
+//      free the jobs of a manifest
+void ch341jobsFree(struct ch341jobqueue *queue) {
+    uint32_t i;
+
+    for(i=0; i < queue->njobs; i++) {
+        free(queue->jobs[i].job.filename);
+        free(queue->jobs[i].line);              // the range and target files point into it
+    }
+    free(queue->jobs);
+    queue->jobs  = NULL;
+    queue->njobs = 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341jobsWorker()
+//      thread of one adapter: take the next job from the queue and run it, until
+//      the queue is empty or the run is interrupted. an adapter that finishes a
+//      short job goes straight on to the next, so a long one only holds up the
+//      adapter it runs on
+void *ch341jobsWorker(void *arg) {
+    struct ch341jobsworker *worker = (struct ch341jobsworker *) arg;
+    struct ch341manifestjob *entry;
+    double start;
+
+    while(!ch341interrupted) {
+        pthread_mutex_lock(&worker->queue->lock);
+        entry = worker->queue->next < worker->queue->njobs ? &worker->queue->jobs[worker->queue->next++] : NULL;
+        pthread_mutex_unlock(&worker->queue->lock);
+        if(!entry)
+            break;
+
+        start = ch341progressNow();
+        entry->adapter = worker->index;
+        fprintf(msgout, "Running job on line [%d] on adapter [%d]\n", entry->lineno, worker->index);
+        if(entry->job.speed != worker->speed && ch341setstream(worker->ctx, entry->job.speed) < 0) {
+            fprintf(stderr, "Couldnt set i2c bus speed of adapter [%d] for the job on line [%d]\n", worker->index, entry->lineno);
+            entry->status = EXIT_ERROR;
+        } else {
+            worker->speed = entry->job.speed;
+            entry->status = ch341setupTWR(&entry->job, worker->ctx) < 0 ? EXIT_ERROR : ch341runJob(&entry->job, worker->ctx, worker->readbuf);
+        }
+        entry->seconds = ch341progressNow() - start;
+        worker->busy += entry->seconds;
+        worker->done++;
+    }
+    return NULL;
+}
+
+// --------------------------------------------------------------------------
+// ch341jobsRun()
+//      run the jobs of the manifest of job on every CH341 attached, one thread
+//      per adapter taking jobs from a shared queue, then print a table of the
+//      jobs and one of the adapters. ctx only finds the adapters.
+//      returns EXIT_OK if all jobs passed, else the status of the first that didnt
+int32_t ch341jobsRun(struct ch341job *job, struct ch341ctx *ctx) {
+    struct ch341ctx *adapters[MAX_GANG_ADAPTERS];
+    struct ch341jobsworker *workers = NULL;
+    struct ch341manifestjob *entry;
+    struct ch341jobqueue queue;
+    int32_t n, i, passed = 0, status = EXIT_OK;
+    double start;
+
+    if(ch341jobsLoad(job, &queue) < 0)
+        return EXIT_ERROR;
+
+    if((n = ch341configureAll(ctx, USB_LOCK_VENDOR, USB_LOCK_PRODUCT, adapters, MAX_GANG_ADAPTERS)) <= 0) {
+        if(!n)
+            fprintf(stderr, "Couldnt find any USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+        ch341jobsFree(&queue);
+        pthread_mutex_destroy(&queue.lock);
+        return EXIT_ERROR;
+    }
+    fprintf(msgout, "Running [%d] jobs on [%d] adapters\n", queue.njobs, n);
+
+    if(!(workers = (struct ch341jobsworker *) calloc(n, sizeof(struct ch341jobsworker)))) {
+        fprintf(stderr, "Couldnt allocate memory for [%d] adapters\n", n);
+        status = EXIT_ERROR;
+        goto out;
+    }
+
+    if(n > 1)                                       // progress lines of several adapters would only garble
+        for(i=0; i < queue.njobs; i++)
+            queue.jobs[i].job.tuning.progressmode = PROGRESS_OFF;
+    start = ch341progressNow();
+
+    for(i=0; i < n; i++) {
+        workers[i].index   = i;
+        workers[i].ctx     = adapters[i];
+        ch341ctxLocation(adapters[i], &workers[i].bus, &workers[i].address);
+        workers[i].speed   = (uint32_t) -1;         // set before the first job
+        workers[i].queue   = &queue;
+        if(!(workers[i].readbuf = (uint8_t *) malloc(MAX_EEPROM_SIZE))) {
+            fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
+            continue;
+        }
+        if(pthread_create(&workers[i].thread, NULL, ch341jobsWorker, &workers[i])) {
+            fprintf(stderr, "Couldnt start the thread of the adapter on bus [%d] device [%d]\n", workers[i].bus, workers[i].address);
+            free(workers[i].readbuf);
+            workers[i].readbuf = NULL;
+        }
+    }
+
+    for(i=0; i < n; i++)
+        if(workers[i].readbuf) {
+            pthread_join(workers[i].thread, NULL);
+            free(workers[i].readbuf);
+        }
+
+    fprintf(msgout, "\nLine  Adapter  Operation  EEPROM   Result     Time     File\n");
+    for(i=0; i < queue.njobs; i++) {
+        entry = &queue.jobs[i];
+        if(entry->adapter < 0)
+            fprintf(msgout, "%4d  %7s  %-9s  %-7s  %-9s  %6s   %s\n", entry->lineno, "-", ch341jobsOpName(entry->job.operation),
+                    entry->job.eepromname, "skipped", "-", entry->job.filename ? entry->job.filename : "-");
+        else
+            fprintf(msgout, "%4d  %7d  %-9s  %-7s  %-9s  %6.2fs  %s\n", entry->lineno, entry->adapter, ch341jobsOpName(entry->job.operation),
+                    entry->job.eepromname, ch341resultName(entry->status), entry->seconds, entry->job.filename ? entry->job.filename : "-");
+        if(entry->status == EXIT_OK)
+            passed++;
+        else if(status == EXIT_OK)
+            status = entry->status;
+    }
+
+    fprintf(msgout, "\nAdapter  Bus  Device  Jobs  Busy\n");
+    for(i=0; i < n; i++)
+        fprintf(msgout, "%7d  %3d  %6d  %4d  %6.2fs\n", i, workers[i].bus, workers[i].address, workers[i].done, workers[i].busy);
+    fprintf(msgout, "[%d] of [%d] jobs passed in [%.2fs]\n", passed, queue.njobs, ch341progressNow() - start);
+
+out:
+    for(i=0; i < n; i++)
+        ch341ctxFree(adapters[i]);                  // releases and closes its adapter
+    free(workers);
+    fprintf(verbout, "Closed [%d] USB devices\n", n);
+    ch341jobsFree(&queue);
+    pthread_mutex_destroy(&queue.lock);
+    return status;
+}
@@ -0,0 +1,120 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+// --------------------------------------------------------------------------
+// ch341progressNow()
+//      monotonic wall-clock time in seconds
+double ch341progressNow(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// --------------------------------------------------------------------------
+// ch341progressParseMode()
+//      passed a progress mode name, returns its PROGRESS_* value or -1
+int32_t ch341progressParseMode(char *name) {
+    if(!strcmp(name, "auto"))
+        return PROGRESS_AUTO;
+    if(!strcmp(name, "tty"))
+        return PROGRESS_TTY;
+    if(!strcmp(name, "machine"))
+        return PROGRESS_MACHINE;
+    if(!strcmp(name, "none"))
+        return PROGRESS_OFF;
+    return -1;
+}
+
+// --------------------------------------------------------------------------
+// ch341progressPrint()
+//      emit one progress report with throughput and estimated time left
+void ch341progressPrint(struct ch341progress *progress, uint32_t done, double now) {
+    double elapsed = now - progress->start;
+    double rate = (elapsed > 0) ? done / elapsed : 0;
+    double eta = (rate > 0) ? (progress->total - done) / rate : 0;
+
+    if(progress->mode == PROGRESS_MACHINE) {
+        fprintf(progress->out, "progress op=%s done=%u total=%u rate=%.0f eta=%.1f\n",
+            progress->op, done, progress->total, rate, eta);
+        fflush(progress->out);
+        return;
+    }
+    fprintf(progress->out, "%s %d%% [%d] of [%d] bytes, %.1f KiB/s, ETA %d:%02d      \r",
+        progress->label, progress->total ? (int) (100.0*done/progress->total) : 100, done, progress->total,
+        rate / 1024, (int) eta / 60, (int) eta % 60);
+    fflush(progress->out);
+}
+
+// --------------------------------------------------------------------------
+// ch341progressStart()
+//      begin reporting an operation over total bytes on the messages of ctx
+//      label is shown on the terminal ("Read"), op names it for machine output ("read")
+void ch341progressStart(struct ch341progress *progress, struct ch341ctx *ctx, char *label, char *op, uint32_t total) {
+    memset(progress, 0, sizeof(struct ch341progress));
+    progress->out = ctx->msgout;
+    progress->label = label;
+    progress->op = op;
+    progress->total = total;
+    progress->start = ch341progressNow();
+
+    progress->mode = ctx->tuning.progressmode;
+    if(progress->mode == PROGRESS_AUTO)             // nobody watches a pipe or a log file
+        progress->mode = isatty(fileno(progress->out)) ? PROGRESS_TTY : PROGRESS_OFF;
+}
+
+// --------------------------------------------------------------------------
+// ch341progressUpdate()
+//      report that done bytes are finished; cheap enough to call on every
+//      loop pass, output is limited to one line per PROGRESS_INTERVAL
+void ch341progressUpdate(struct ch341progress *progress, uint32_t done) {
+    double now;
+
+    if(progress->mode == PROGRESS_OFF)
+        return;
+    now = ch341progressNow();
+    if(now - progress->last < PROGRESS_INTERVAL)
+        return;
+    progress->last = now;
+    ch341progressPrint(progress, done, now);
+}
+
+// --------------------------------------------------------------------------
+// ch341progressEnd()
+//      print the final state of the operation and finish the line
+void ch341progressEnd(struct ch341progress *progress, uint32_t done) {
+    if(progress->mode == PROGRESS_OFF)
+        return;
+    ch341progressPrint(progress, done, ch341progressNow());
+    if(progress->mode == PROGRESS_TTY)
+        fprintf(progress->out, "\n");
+}
@@ -0,0 +1,324 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <errno.h>
+#include <getopt.h>
+#include <limits.h>
+#include <unistd.h>
+#include <signal.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+extern FILE *debugout, *verbout, *msgout;
+
+// --------------------------------------------------------------------------
+// ch341unixAddress()
+//      fill in the address of a Unix socket, -1 if the path is too long
+int32_t ch341unixAddress(struct sockaddr_un *addr, char *path) {
+    memset(addr, 0, sizeof(struct sockaddr_un));
+    addr->sun_family = AF_UNIX;
+    if(strlen(path) >= sizeof(addr->sun_path)) {
+        fprintf(stderr, "Socket path [%s] is too long\n", path);
+        return -1;
+    }
+    strcpy(addr->sun_path, path);
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341serveRequest()
+//      run one job sent by a client. the request is a 32 bit length followed by
+//      the client's working directory and its arguments, each NUL terminated,
+//      and carries the client's stdin, stdout and stderr, so the job reads and
+//      prints as if it ran in the client. the exit status goes back as one byte
+//      returns the exit status of the job
+int32_t ch341serveRequest(int conn, struct ch341ctx *ctx, uint8_t *readbuf, uint32_t *speed, struct ch341tuning *tuning) {
+    char request[SERVE_MAX_REQUEST + 1], cwd[PATH_MAX], *argv[SERVE_MAX_ARGS + 1], *p;
+    uint8_t control[CMSG_SPACE(3 * sizeof(int))];
+    int fds[3] = {-1, -1, -1}, saved[3], argc = 0, nfds = 0, fd, i;
+    FILE *servemsg = msgout, *servedebug = debugout, *serveverb = verbout;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    struct ch341job job;
+    uint32_t length;
+    ssize_t got, done;
+    size_t n;
+    int32_t status = EXIT_ERROR;
+    uint8_t result;
+
+    iov[0].iov_base = &length;
+    iov[0].iov_len  = sizeof(length);
+    iov[1].iov_base = request;
+    iov[1].iov_len  = SERVE_MAX_REQUEST;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = iov;
+    msg.msg_iovlen     = 2;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+
+    got = recvmsg(conn, &msg, 0);
+                                                    // the descriptors received are ours to close, even
+                                                    // those of a short or malformed request
+    for(cmsg = got < 0 ? NULL : CMSG_FIRSTHDR(&msg); cmsg; cmsg = CMSG_NXTHDR(&msg, cmsg))
+        if(cmsg->cmsg_level == SOL_SOCKET && cmsg->cmsg_type == SCM_RIGHTS)
+            for(n=0; n < (cmsg->cmsg_len - CMSG_LEN(0)) / sizeof(int); n++) {
+                memcpy(&fd, CMSG_DATA(cmsg) + n * sizeof(int), sizeof(int));
+                if(nfds < 3)
+                    fds[nfds++] = fd;
+                else
+                    close(fd);
+            }
+
+    if(got < (ssize_t) sizeof(length)) {
+        fprintf(stderr, "Couldnt receive a job request\n");
+        goto out;
+    }
+    if(nfds < 3 || length > SERVE_MAX_REQUEST) {
+        fprintf(stderr, "Malformed job request\n");
+        goto out;
+    }
+    for(done = got - sizeof(length); done < length; done += got)  // the rest of a long request
+        if((got = read(conn, request + done, length - done)) <= 0) {
+            fprintf(stderr, "Job request cut short\n");
+            goto out;
+        }
+    request[length] = 0;
+
+    for(p = request + strlen(request) + 1; p < request + length && argc < SERVE_MAX_ARGS; p += strlen(p) + 1)
+        argv[argc++] = p;
+    argv[argc] = NULL;
+    if(!argc) {
+        fprintf(stderr, "Job request has no arguments\n");
+        goto out;
+    }
+
+    if(!getcwd(cwd, sizeof(cwd)) || chdir(request) < 0) {
+        dprintf(fds[2], "Server couldnt change to directory [%s]\n", request);
+        goto out;
+    }
+
+    fflush(stdout);
+    fflush(stderr);
+    for(i=0; i < 3; i++) {                          // the job runs on the client's terminal
+        saved[i] = dup(i);
+        dup2(fds[i], i);
+    }
+
+    ch341jobInit(&job);
+    job.tuning = *tuning;                           // the options the server was started with
+    #if defined(__APPLE__) || defined(__FreeBSD__)
+        optreset = 1;
+        optind = 1;
+    #else
+        optind = 0;                                 // getopt starts over on the next argv
+    #endif
+    if((status = ch341parseJob(argc, argv, &job)) != 0)
+        status = status > 0 ? EXIT_OK : EXIT_ERROR;
+    else if(job.serve || job.gang || job.manifest || job.emulate) {
+        fprintf(stderr, "Jobs sent to a server cant serve, gang, emulate or run a manifest\n");
+        status = EXIT_ERROR;
+    } else if(job.speed != *speed && ch341setstream(ctx, job.speed) < 0) {
+        fprintf(stderr, "Couldnt set i2c bus speed\n");
+        status = EXIT_ERROR;
+    } else {
+        *speed = job.speed;
+        status = ch341setupTWR(&job, ctx) < 0 ? EXIT_ERROR : ch341runJob(&job, ctx, readbuf);
+    }
+    free(job.filename);                             // the range files point into the request
+
+    fflush(stdout);
+    fflush(stderr);
+    for(i=0; i < 3; i++) {
+        dup2(saved[i], i);
+        close(saved[i]);
+    }
+    msgout   = servemsg;
+    debugout = servedebug;
+    verbout  = serveverb;
+    ch341ctxSetOutput(ctx, msgout, verbout, debugout);
+    if(chdir(cwd) < 0)
+        fprintf(stderr, "Couldnt change back to directory [%s]\n", cwd);
+    fprintf(verbout, "Served a job from [%s] with status [%d]\n", request, status);
+
+out:
+    result = status;
+    if(write(conn, &result, 1) != 1)
+        fprintf(verbout, "Client left before its job finished\n");
+    for(i=0; i < 3; i++)
+        if(fds[i] >= 0)
+            close(fds[i]);
+    return status;
+}
+
+// --------------------------------------------------------------------------
+// ch341serve()
+//      claim the adapter once and run the jobs of clients connecting to the
+//      socket, one after the other, until interrupted
+//      returns the exit status of the server
+int32_t ch341serve(struct ch341job *served, uint8_t *readbuf) {
+    struct ch341ctx *ctx;
+    struct sockaddr_un addr;
+    struct sigaction sa;
+    uint32_t speed = served->speed;
+    int sock, conn;
+    int32_t jobs = 0, status = EXIT_ERROR;
+
+    if(ch341unixAddress(&addr, served->serve) < 0)
+        return EXIT_ERROR;
+
+    if(!(ctx = ch341ctxNew(NULL))) {
+        fprintf(stderr, "Couldnt allocate the adapter context\n");
+        return EXIT_ERROR;
+    }
+    ch341ctxSetOutput(ctx, msgout, verbout, debugout);
+    ch341ctxSetCancel(ctx, &ch341interrupted);
+    if(served->emulate && ch341ctxEmulate(ctx, &served->emu) < 0) {
+        ch341ctxFree(ctx);
+        return EXIT_ERROR;
+    }
+    if(ch341configure(ctx, USB_LOCK_VENDOR, USB_LOCK_PRODUCT) < 0) {
+        fprintf(stderr, "Couldnt configure USB device with vendor ID: %04x product ID: %04x\n", USB_LOCK_VENDOR, USB_LOCK_PRODUCT);
+        ch341ctxFree(ctx);
+        return EXIT_ERROR;
+    }
+    if(ch341setstream(ctx, speed) < 0) {
+        fprintf(stderr, "Couldnt set i2c bus speed\n");
+        goto out;
+    }
+
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0) {
+        fprintf(stderr, "Couldnt create socket: '%s'\n", strerror(errno));
+        goto out;
+    }
+    unlink(served->serve);                          // left behind by a server that was killed
+    if(bind(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0 || listen(sock, SERVE_BACKLOG) < 0) {
+        fprintf(stderr, "Couldnt listen on socket [%s]: '%s'\n", served->serve, strerror(errno));
+        close(sock);
+        goto out;
+    }
+
+    sigaction(SIGINT, NULL, &sa);                   // without SA_RESTART, so a signal ends the wait in accept()
+    sa.sa_flags &= ~SA_RESTART;
+    sigaction(SIGINT, &sa, NULL);
+    sigaction(SIGTERM, &sa, NULL);
+    signal(SIGPIPE, SIG_IGN);                       // a client that went away must not end the server
+
+    fprintf(msgout, "Serving jobs on [%s]\n", served->serve);
+    fflush(msgout);
+
+    while(!ch341interrupted) {
+        if((conn = accept(sock, NULL, NULL)) < 0) {
+            if(errno != EINTR)
+                fprintf(stderr, "Couldnt accept a client: '%s'\n", strerror(errno));
+            continue;
+        }
+        ch341serveRequest(conn, ctx, readbuf, &speed, &served->tuning);
+        close(conn);
+        jobs++;
+    }
+    fprintf(msgout, "Stopped serving after [%d] jobs\n", jobs);
+    close(sock);
+    unlink(served->serve);
+    status = EXIT_OK;
+
+out:
+    ch341ctxFree(ctx);                              // releases and closes the adapter
+    return status;
+}
+
+// --------------------------------------------------------------------------
+// ch341clientRun()
+//      hand the command line to the server at path, along with this process'
+//      stdin, stdout and stderr, and wait for the job to finish
+//      returns the exit status of the job
+int32_t ch341clientRun(char *path, int argc, char **argv) {
+    char request[SERVE_MAX_REQUEST];
+    uint8_t control[CMSG_SPACE(3 * sizeof(int))];
+    int fds[3] = {STDIN_FILENO, STDOUT_FILENO, STDERR_FILENO};
+    struct sockaddr_un addr;
+    struct iovec iov[2];
+    struct msghdr msg;
+    struct cmsghdr *cmsg;
+    uint32_t length;
+    size_t n;
+    int sock, i;
+    uint8_t result;
+
+    if(!getcwd(request, sizeof(request))) {
+        fprintf(stderr, "Couldnt get the working directory\n");
+        return EXIT_ERROR;
+    }
+    length = strlen(request) + 1;
+    for(i=0; i < argc; i++) {
+        if((n = strlen(argv[i]) + 1) > SERVE_MAX_REQUEST - length) {
+            fprintf(stderr, "Command line too long to send to the server\n");
+            return EXIT_ERROR;
+        }
+        memcpy(request + length, argv[i], n);
+        length += n;
+    }
+
+    if(ch341unixAddress(&addr, path) < 0)
+        return EXIT_ERROR;
+    if((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0 || connect(sock, (struct sockaddr *) &addr, sizeof(addr)) < 0) {
+        fprintf(stderr, "Couldnt connect to the server at [%s]: '%s'\n", path, strerror(errno));
+        if(sock >= 0)
+            close(sock);
+        return EXIT_ERROR;
+    }
+
+    iov[0].iov_base = &length;
+    iov[0].iov_len  = sizeof(length);
+    iov[1].iov_base = request;
+    iov[1].iov_len  = length;
+    memset(&msg, 0, sizeof(msg));
+    msg.msg_iov        = iov;
+    msg.msg_iovlen     = 2;
+    msg.msg_control    = control;
+    msg.msg_controllen = sizeof(control);
+    cmsg = CMSG_FIRSTHDR(&msg);
+    cmsg->cmsg_level = SOL_SOCKET;
+    cmsg->cmsg_type  = SCM_RIGHTS;
+    cmsg->cmsg_len   = CMSG_LEN(sizeof(fds));
+    memcpy(CMSG_DATA(cmsg), fds, sizeof(fds));
+
+    if(sendmsg(sock, &msg, 0) != (ssize_t) (sizeof(length) + length)) {
+        fprintf(stderr, "Couldnt send the job to the server at [%s]\n", path);
+        close(sock);
+        return EXIT_ERROR;
+    }
+    if(read(sock, &result, 1) != 1) {
+        fprintf(stderr, "Server at [%s] closed the connection before the job finished\n", path);
+        close(sock);
+        return EXIT_ERROR;
+    }
+    close(sock);
+    return result;
+}
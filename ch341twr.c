@@ -0,0 +1,161 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+// --------------------------------------------------------------------------
+// ch341calibrateSample()
+//      rewrite the page at addr with its own contents and time the write cycle
+//      on the CH341: the page is followed in the same transfer by ACK polls each
+//      1ms after the previous one. returns the number of polls up to and
+//      including the first acknowledged one, -1 on error
+int32_t ch341calibrateSample(struct ch341ctx *ctx, struct EEPROM *eeprom_info, uint32_t addr, uint8_t *page) {
+    uint8_t ch341outBuffer[CH341_MAX_BULK_OUT_SZ], status[mCH341_PACKET_LENGTH], *ptr;
+    int32_t ret, actuallen = 0, i, twr = -1;
+    size_t len;
+
+    memset(ch341outBuffer, 0, sizeof(ch341outBuffer));
+    len = CH341_PKT_ALIGN(ch341WriteCmdMarshall(ch341outBuffer, addr, page, eeprom_info->page_size, eeprom_info));
+    for(i = 0; i < CALIBRATE_MAX_TWR; i++) {           // one frame per packet: wait 1ms, then poll
+        ptr = ch341outBuffer + len;
+        *ptr++ = mCH341A_CMD_I2C_STREAM;
+        *ptr++ = mCH341A_CMD_I2C_STM_MS | 1;
+        *ptr++ = mCH341A_CMD_I2C_STM_STA;
+        *ptr++ = mCH341A_CMD_I2C_STM_OUT;               // OUT with no length returns the ACK status
+        *ptr++ = ch341i2cAddress(eeprom_info, addr);
+        *ptr++ = mCH341A_CMD_I2C_STM_STO;
+        *ptr++ = mCH341A_CMD_I2C_STM_END;
+        len += mCH341_PACKET_LENGTH;
+    }
+
+    ret = ctx->transport->bulk(ctx, BULK_WRITE_ENDPOINT, ch341outBuffer, len, &actuallen, DEFAULT_TIMEOUT);
+    if(ret < 0) {
+        fprintf(stderr, "Failed to write to EEPROM: '%s'\n", strerror(-ret));
+        return -1;
+    }
+                                                    // one status packet per poll
+    for(i = 0; i < CALIBRATE_MAX_TWR; i++) {
+        ret = ctx->transport->bulk(ctx, BULK_READ_ENDPOINT, status, sizeof(status), &actuallen, DEFAULT_TIMEOUT);
+        if(ret < 0 || actuallen != 1) {
+            fprintf(stderr, "Failed to read ACK status from EEPROM: '%s'\n", strerror(-ret));
+            return -1;
+        }
+        if(twr < 0 && !(status[0] & 0x80))
+            twr = i + 1;
+    }
+    if(twr < 0)
+        fprintf(stderr, "EEPROM did not acknowledge %d polls after writing address [%04x]\n", CALIBRATE_MAX_TWR, addr);
+    return twr;
+}
+
+// --------------------------------------------------------------------------
+// ch341calibrateTWR()
+//      measure the write cycle time of the attached part on its last page,
+//      whose contents are kept. each poll also takes about three byte times on
+//      a bus running at khz, so the n-th one is at most n * (1ms + poll) after
+//      the page. returns that bound for the slowest of CALIBRATE_SAMPLES write
+//      cycles, rounded up to ms, or -1 on error
+int32_t ch341calibrateTWR(struct ch341ctx *ctx, struct EEPROM *eeprom_info, uint32_t khz) {
+    uint32_t addr = eeprom_info->size - eeprom_info->page_size;
+    uint32_t pollus = 3 * 9 * 1000 / khz;
+    struct ch341range range = {addr, eeprom_info->page_size};
+    int32_t i, polls, twr, longest = 0;
+    uint8_t *chip;
+
+    if(!(chip = (uint8_t *) malloc(eeprom_info->size))) {
+        fprintf(stderr, "Couldnt malloc space needed for EEPROM image\n");
+        return -1;
+    }
+    if(ch341readRanges(ctx, chip, &range, 1, eeprom_info, NULL, NULL) < 0) {
+        free(chip);
+        return -1;
+    }
+    for(i = 0; i < CALIBRATE_SAMPLES; i++) {
+        if((polls = ch341calibrateSample(ctx, eeprom_info, addr, chip + addr)) < 0) {
+            free(chip);
+            return -1;
+        }
+        twr = (polls * (1000 + pollus) + 999) / 1000;
+        fprintf(ctx->debugout, "Write cycle of page [%04x] ended by poll %d, within %dms\n", addr, polls, twr);
+        longest = MAX(longest, twr);
+    }
+    free(chip);
+    return longest;
+}
+
+// --------------------------------------------------------------------------
+// ch341twrDelay()
+//      per page delay for a measured tWR, with a safety margin
+uint32_t ch341twrDelay(uint32_t twr) {
+    return twr + MAX(CALIBRATE_MARGIN, twr / 4);
+}
+
+// --------------------------------------------------------------------------
+// ch341twrCacheLoad()
+//      look up the delay stored for an EEPROM type in a cache file of
+//      "<type> <ms>" lines. returns the delay in ms, -1 if there is none
+int32_t ch341twrCacheLoad(char *filename, char *eepromname) {
+    char name[16];
+    int32_t ms, found = -1;
+    FILE *fp;
+
+    if(!(fp = fopen(filename, "r")))
+        return -1;
+    while(fscanf(fp, "%15s %d", name, &ms) == 2)
+        if(!strcmp(name, eepromname) && ms > 0)
+            found = ms;
+    fclose(fp);
+    return found;
+}
+
+// --------------------------------------------------------------------------
+// ch341twrCacheSave()
+//      store the delay for an EEPROM type in the cache file, keeping the
+//      entries of other types. returns -1 on error
+int32_t ch341twrCacheSave(char *filename, char *eepromname, uint32_t delay) {
+    char names[CALIBRATE_CACHE_ENTRIES][16];
+    int32_t delays[CALIBRATE_CACHE_ENTRIES], n = 0, i;
+    FILE *fp;
+
+    if((fp = fopen(filename, "r"))) {
+        while(n < CALIBRATE_CACHE_ENTRIES && fscanf(fp, "%15s %d", names[n], &delays[n]) == 2)
+            if(strcmp(names[n], eepromname))
+                n++;
+        fclose(fp);
+    }
+    if(!(fp = fopen(filename, "w"))) {
+        fprintf(stderr, "Couldnt open file [%s] for writing\n", filename);
+        return -1;
+    }
+    for(i = 0; i < n; i++)
+        fprintf(fp, "%s %d\n", names[i], delays[i]);
+    fprintf(fp, "%s %d\n", eepromname, delay);
+    fclose(fp);
+    return 0;
+}
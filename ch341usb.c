@@ -0,0 +1,204 @@
+//
+// ch341eeprom programmer version 0.1 (Beta)
+//
+//  Programming tool for the 24Cxx serial EEPROMs using the Winchiphead CH341A IC
+//
+// (c) December 2011 asbokid <ballymunboy@gmail.com>
+//
+//   This program is free software: you can redistribute it and/or modify
+//   it under the terms of the GNU General Public License as published by
+//   the Free Software Foundation, either version 3 of the License, or
+//   (at your option) any later version.
+//
+//   This program is distributed in the hope that it will be useful,
+//   but WITHOUT ANY WARRANTY; without even the implied warranty of
+//   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+//   GNU General Public License for more details.
+//
+//   You should have received a copy of the GNU General Public License
+//   along with this program.  If not, see <http://www.gnu.org/licenses/>.
+
+#include <libusb-1.0/libusb.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
+#include <signal.h>
+#include <pthread.h>
+#include "libch341eeprom.h"
+#include "ch341eeprom.h"
+
+// the transport of real CH341s, each context on a libusb context of its own
+struct ch341transport ch341usbTransport = {
+    ch341usbOpen, ch341usbClose, ch341usbRelease, ch341usbLocation, ch341usbBulk,
+    ch341usbAlloc, libusb_free_transfer, libusb_submit_transfer, libusb_cancel_transfer, ch341usbEvents
+};
+
+// --------------------------------------------------------------------------
+// ch341usbClaim()
+//      detach the kernel driver from an opened CH341 and claim its interface
+//      messages go to the streams of ctx. returns 0 on success, -1 on error
+int32_t ch341usbClaim(struct ch341ctx *ctx, struct libusb_device_handle *devHandle) {
+    int32_t ret=0;
+    int32_t currentConfig = 0;
+    uint32_t i = 0;
+
+    uint8_t ch341DescriptorBuffer[0x12];
+
+    if(libusb_kernel_driver_active(devHandle, DEFAULT_INTERFACE)) {
+        ret = libusb_detach_kernel_driver(devHandle, DEFAULT_INTERFACE);
+        if(ret) {
+            fprintf(stderr, "Failed to detach kernel driver: '%s'\n", strerror(-ret));
+            return -1;
+        } else
+            fprintf(ctx->verbout, "Detached kernel driver\n");
+    }
+
+    ret = libusb_get_configuration(devHandle, &currentConfig);
+    if(ret) {
+        fprintf(stderr, "Failed to get current device configuration: '%s'\n", strerror(-ret));
+        return -1;
+    }
+
+    if(currentConfig != DEFAULT_CONFIGURATION)
+        ret = libusb_set_configuration(devHandle, currentConfig);
+
+    if(ret) {
+        fprintf(stderr, "Failed to set device configuration to %d: '%s'\n", DEFAULT_CONFIGURATION, strerror(-ret));
+        return -1;
+    }
+
+    ret = libusb_claim_interface(devHandle, DEFAULT_INTERFACE); // interface 0
+
+    if(ret == LIBUSB_ERROR_BUSY) {                  // another context of this process, or another program, has it
+        fprintf(ctx->verbout, "Device interface [%d] is already claimed, skipped\n", DEFAULT_INTERFACE);
+        return -1;
+    } else if(ret) {
+        fprintf(stderr, "Failed to claim interface %d: '%s'\n", DEFAULT_INTERFACE, strerror(-ret));
+        return -1;
+    }
+
+    fprintf(ctx->verbout, "Claimed device interface [%d]\n", DEFAULT_INTERFACE);
+
+    ret = libusb_get_descriptor(devHandle, LIBUSB_DT_DEVICE, 0x00, ch341DescriptorBuffer, 0x12);
+
+    if(ret < 0) {
+        fprintf(stderr, "Failed to get device descriptor: '%s'\n", strerror(-ret));
+        return -1;
+    }
+
+    fprintf(ctx->verbout, "Device reported its revision [%d.%02d]\n",
+        ch341DescriptorBuffer[12], ch341DescriptorBuffer[13]);
+
+    for(i=0;i<0x12;i++)
+        fprintf(ctx->debugout,"%02x ", ch341DescriptorBuffer[i]);
+    fprintf(ctx->debugout,"\n");
+
+    return 0;
+}
+
+// --------------------------------------------------------------------------
+// ch341usbOpen()
+//      open and claim the CH341s on the USB buses that nobody has claimed yet,
+//      up to max of them, on the libusb context of ctx
+//      returns the number of adapters in handles, -1 on error
+int32_t ch341usbOpen(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct libusb_device_handle **handles, int32_t max) {
+    struct libusb_device **list;
+    struct libusb_device_descriptor desc;
+    ssize_t ndevs, i;
+    int32_t n = 0, ret;
+
+    if(!ctx->usb) {
+        ret = libusb_init(&ctx->usb);
+        if(ret < 0) {
+            fprintf(stderr, "Couldnt initialise libusb\n");
+            ctx->usb = NULL;
+            return -1;
+        }
+
+        #if LIBUSBX_API_VERSION < 0x01000106
+            libusb_set_debug(ctx->usb, 3);          // maximum debug logging level
+        #else
+            libusb_set_option(ctx->usb, LIBUSB_OPTION_LOG_LEVEL, 3);
+        #endif
+    }
+
+    fprintf(ctx->verbout, "Searching USB buses for WCH CH341a i2c EEPROM programmer [%04x:%04x]\n", vid, pid);
+
+    if((ndevs = libusb_get_device_list(ctx->usb, &list)) < 0) {
+        fprintf(stderr, "Couldnt list USB devices: '%s'\n", strerror(-ndevs));
+        return -1;
+    }
+
+    for(i=0; i < ndevs && n < max; i++) {
+        if(libusb_get_device_descriptor(list[i], &desc) < 0 || desc.idVendor != vid || desc.idProduct != pid)
+            continue;
+        if((ret = libusb_open(list[i], &handles[n])) < 0) {
+            fprintf(stderr, "Couldnt open device [%d] on USB bus [%d]: '%s'\n",
+                libusb_get_device_address(list[i]), libusb_get_bus_number(list[i]), strerror(-ret));
+            continue;
+        }
+        fprintf(ctx->verbout, "Found [%04x:%04x] as device [%d] on USB bus [%d]\n", vid, pid,
+            libusb_get_device_address(list[i]), libusb_get_bus_number(list[i]));
+        fprintf(ctx->verbout, "Opened device [%04x:%04x]\n", vid, pid);
+        if(ch341usbClaim(ctx, handles[n]) < 0) {
+            libusb_close(handles[n]);
+            continue;
+        }
+        n++;
+    }
+    libusb_free_device_list(list, 1);
+    return n;
+}
+
+// --------------------------------------------------------------------------
+// ch341usbClose()
+//      release the interface of the adapter of ctx and close it
+void ch341usbClose(struct ch341ctx *ctx) {
+    libusb_release_interface(ctx->devHandle, DEFAULT_INTERFACE);
+    fprintf(ctx->debugout, "Released device interface [%d]\n", DEFAULT_INTERFACE);
+    libusb_close(ctx->devHandle);
+    fprintf(ctx->verbout, "Closed USB device\n");
+}
+
+// --------------------------------------------------------------------------
+// ch341usbRelease()
+//      let go of the libusb context of ctx, once its adapter is closed
+void ch341usbRelease(struct ch341ctx *ctx) {
+    if(ctx->usb)
+        libusb_exit(ctx->usb);
+    ctx->usb = NULL;
+}
+
+// --------------------------------------------------------------------------
+// ch341usbLocation()
+//      bus number and device address of the adapter of ctx
+void ch341usbLocation(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address) {
+    struct libusb_device *dev = libusb_get_device(ctx->devHandle);
+
+    *bus     = libusb_get_bus_number(dev);
+    *address = libusb_get_device_address(dev);
+}
+
+// --------------------------------------------------------------------------
+// ch341usbBulk()
+//      synchronous bulk transfer to or from the adapter of ctx
+int ch341usbBulk(struct ch341ctx *ctx, uint8_t endpoint, uint8_t *data, int len, int *actual, uint32_t timeout) {
+    return libusb_bulk_transfer(ctx->devHandle, endpoint, data, len, actual, timeout);
+}
+
+// --------------------------------------------------------------------------
+// ch341usbAlloc()
+//      a bulk transfer, without isochronous packets
+struct libusb_transfer *ch341usbAlloc(void) {
+    return libusb_alloc_transfer(0);
+}
+
+// --------------------------------------------------------------------------
+// ch341usbEvents()
+//      wait up to tv for transfers of the adapter of ctx to complete and call
+//      them back. its libusb context has no others, so no other thread ever
+//      runs them
+int ch341usbEvents(struct ch341ctx *ctx, struct timeval *tv, int *completed) {
+    return libusb_handle_events_timeout_completed(ctx->usb, tv, completed);
+}
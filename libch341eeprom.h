@@ -0,0 +1,110 @@
+// libch341eeprom - i2c EEPROM programming with the WCH CH341a
+//
+// Copyright 2011 asbokid <ballymunboy@gmail.com>
+//
+// Public interface of the library. Each adapter is driven through its own
+// context, which holds the USB handle, the transfer tuning, the message
+// streams and the cancel flag; the library keeps no other state, so any
+// number of adapters can be run from one process, each on its own thread.
+// Every adapter gets a libusb context of its own, so its transfers are only
+// called back on the thread that waits for them. ch341ctxEmulate() puts a
+// context on the built-in emulator instead.
+
+#ifndef LIBCH341EEPROM_H
+#define LIBCH341EEPROM_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <signal.h>
+
+struct libusb_device_handle;
+struct ch341ctx;                    // opaque, one per adapter
+
+#define PROGRESS_OFF                0      // progress output modes
+#define PROGRESS_AUTO               1      // terminal line if messages go to a tty, otherwise nothing
+#define PROGRESS_TTY                2
+#define PROGRESS_MACHINE            3      // key=value lines for log parsers
+
+struct EEPROM {
+    char *name;
+    uint32_t size;
+    uint16_t page_size;
+    uint8_t addr_size; // Length of addres in bytes
+    uint8_t addr; // value of the (up to) three EEPROM address select pins
+};
+
+// a span of EEPROM addresses
+struct ch341range {
+    uint32_t offset;
+    uint32_t length;
+};
+
+// called for every block of a read as it completes, in address order; return < 0 to abort
+typedef int32_t (*ch341blockcb)(uint32_t offset, uint8_t *data, uint32_t len, void *arg);
+
+// streaming verify against an image: what differed so far
+struct ch341verify {
+    uint8_t *image;         // expected contents, indexed by EEPROM address
+    uint8_t fullreport;     // read on past the first mismatch and collect ranges
+    uint32_t mismatches;    // bytes differing
+    uint32_t first;         // address of the first one
+    struct ch341range *ranges;  // mismatching ranges, only with fullreport
+    uint32_t nranges;
+    uint32_t maxranges;
+};
+
+// how a context reads and writes, see ch341tuningDefaults()
+struct ch341tuning {
+    uint32_t readqueuedepth;    // 0x80 byte blocks kept in flight while reading
+    uint8_t readsequential;     // one i2c transaction per region instead of per block
+    uint8_t writeackpoll;       // poll for the end of each write cycle instead of waiting
+    uint32_t writebatch;        // pages (each with its wait) per BULK OUT transfer
+    uint8_t writeverify;        // read back each page as part of the write
+    uint32_t writecycledelay;   // ms the CH341 waits after each page
+    uint8_t progressmode;       // PROGRESS_ mode of the progress reports
+};
+
+// CH341s and 24Cxx EEPROMs emulated in the process, see ch341emuParse()
+struct ch341emuconfig {
+    char *dir;                  // one file per EEPROM keeps its contents between runs
+    char *chip;                 // 24Cxx type of every EEPROM
+    uint32_t adapters;          // CH341s found by ch341configureAll()
+    uint32_t chips;             // EEPROMs on each i2c bus, from chip select 0 up
+    uint32_t latencyus;         // USB round trip of a transfer
+    uint32_t twrus;             // write cycle, during which the EEPROM NACKs its address
+    uint8_t keepfifo;           // BULK IN data left unread outlives the run, as on an adapter left plugged in
+};
+
+struct ch341ctx *ch341ctxNew(struct libusb_device_handle *devHandle);
+void ch341ctxFree(struct ch341ctx *ctx);
+struct libusb_device_handle *ch341ctxHandle(struct ch341ctx *ctx);
+struct ch341tuning *ch341ctxTuning(struct ch341ctx *ctx);
+void ch341ctxSetOutput(struct ch341ctx *ctx, FILE *msgout, FILE *verbout, FILE *debugout);
+void ch341ctxSetCancel(struct ch341ctx *ctx, volatile sig_atomic_t *cancel);
+void ch341tuningDefaults(struct ch341tuning *tuning);
+int32_t ch341emuParse(char *spec, struct ch341emuconfig *config);
+int32_t ch341ctxEmulate(struct ch341ctx *ctx, struct ch341emuconfig *config);
+void ch341ctxLocation(struct ch341ctx *ctx, uint8_t *bus, uint8_t *address);
+
+int32_t ch341configure(struct ch341ctx *ctx, uint16_t vid, uint16_t pid);
+int32_t ch341configureAll(struct ch341ctx *ctx, uint16_t vid, uint16_t pid, struct ch341ctx **adapters, int32_t max);
+int32_t ch341setstream(struct ch341ctx *ctx, uint32_t speed);
+int32_t parseEEPsize(char* eepromname, struct EEPROM *eeprom);
+
+int32_t ch341readRanges(struct ch341ctx *ctx, uint8_t *buf, struct ch341range *ranges, uint32_t nranges, struct EEPROM* eeprom_info,
+                        ch341blockcb blockcb, void *cbarg);
+int32_t ch341readEEPROM(struct ch341ctx *ctx, uint8_t *buf, uint32_t bytes, struct EEPROM* eeprom_info);
+int32_t ch341writeEEPROM(struct ch341ctx *ctx, uint8_t *buf, uint32_t bytes, struct EEPROM* eeprom_info);
+int32_t ch341writeRanges(struct ch341ctx *ctx, uint8_t *buffer, struct ch341range *ranges, uint32_t nranges, struct EEPROM *eeprom_info);
+int32_t ch341writeTargets(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytes, struct EEPROM *targets, uint32_t ntargets);
+int32_t ch341patchEEPROM(struct ch341ctx *ctx, uint8_t *image, struct ch341range *ranges, uint32_t nranges, struct EEPROM *eeprom_info);
+int32_t ch341fillEEPROM(struct ch341ctx *ctx, uint8_t *pattern, uint32_t patlen, uint32_t bytes, struct EEPROM *eeprom_info);
+int32_t ch341blankCheck(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytes, struct EEPROM *eeprom_info);
+int32_t ch341verifyEEPROM(struct ch341ctx *ctx, uint8_t *buffer, uint32_t bytes, struct ch341verify *verify, struct EEPROM *eeprom_info);
+
+int32_t ch341calibrateTWR(struct ch341ctx *ctx, struct EEPROM *eeprom_info, uint32_t khz);
+uint32_t ch341twrDelay(uint32_t twr);
+int32_t ch341twrCacheLoad(char *filename, char *eepromname);
+int32_t ch341twrCacheSave(char *filename, char *eepromname, uint32_t delay);
+
+#endif